@@ -3,3 +3,12 @@ PREFIX 			?= /usr/local
 BINPREFIX 		:= $(PREFIX)/bin
 MANPREFIX 		:= $(PREFIX)/share/man
 CFGPREFIX 		:= ~/.config/ml
+
+# -march=native builds the activation kernels with AVX2/AVX-512 when available
+CPUFLAGS 		?=
+
+# float64 or float32, weights files can be read by either build
+PRECISION 		?= float64
+
+# openblas, blis, cblas (reference) or internal (no BLAS library)
+BLAS 			?= openblas
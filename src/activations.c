@@ -16,65 +16,257 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 
 #include "nn.h"
 
-double leaky_relu(double x);
-double dleaky_relu(double x);
-double relu(double x);
-double drelu(double x);
-double sigmoid(double x);
-double dsigmoid(double x);
-double softplus(double x);
-double dsoftplus(double x);
-double linear(double x);
-double dlinear(double x);
-double dtanh(double x);
-
-struct Activation NN_LEAKY_RELU = {
-    .func = leaky_relu,
-    .dfunc = dleaky_relu
-};
+/* Whole array activation kernels, see KERNEL_CLONES on nn.h */
+#define VEC_LEN (VEC_BYTES / sizeof(nn_float))
 
-struct Activation NN_SOFTPLUS = {
-    .func = softplus,
-    .dfunc = dsoftplus
-};
+/* exp() range reduction constants of the nn_float format */
+#ifdef NN_FLOAT32
+typedef int32_t nn_int;
+#define EXP_MAX     88.0f
+#define EXP_MIN     -87.0f
+#define EXP_BIAS    127
+#define MANT_BITS   23
+#define ABS_MASK    0x7fffffff
+#define LN2_HI      0x1.62e4p-1f
+#define LN2_LO      0x1.7f7d1cp-20f
+#else
+typedef int64_t nn_int;
+#define EXP_MAX     709.0
+#define EXP_MIN     -708.0
+#define EXP_BIAS    1023
+#define MANT_BITS   52
+#define ABS_MASK    0x7fffffffffffffff
+#define LN2_HI      0x1.62e42fee00000p-1
+#define LN2_LO      0x1.a39ef35793c76p-33
+#endif
 
-struct Activation NN_RELU = {
-    .func = relu,
-    .dfunc = drelu
-};
+typedef nn_float vfloat __attribute__((vector_size(VEC_BYTES)));
+typedef nn_int vint __attribute__((vector_size(VEC_BYTES)));
+
+typedef vfloat (*VecFunc)(vfloat);
+
+// kernels must be inlined into every clone
+#define VEC_INLINE static inline __attribute__((always_inline))
+
+// the vector helpers never survive as calls, so their calling convention does not matter
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+static bool fast_activations = false;
+
+VEC_INLINE vfloat vload(const nn_float *p);
+VEC_INLINE void vstore(nn_float *p, vfloat x);
+VEC_INLINE vfloat vbroadcast(nn_float x);
+VEC_INLINE vfloat vselect(vint mask, vfloat a, vfloat b);
+VEC_INLINE vfloat vexp(vfloat x);
+VEC_INLINE vfloat vexp_fast(vfloat x);
+VEC_INLINE vfloat vexp_poly(vfloat x, const nn_float *coeffs, size_t n);
+VEC_INLINE vfloat vpoly(vfloat x, const nn_float *coeffs, size_t n);
+VEC_INLINE vfloat vlinear(vfloat x);
+VEC_INLINE vfloat vdlinear(vfloat a);
+VEC_INLINE vfloat vsigmoid(vfloat x);
+VEC_INLINE vfloat vsigmoid_fast(vfloat x);
+VEC_INLINE vfloat vdsigmoid(vfloat a);
+VEC_INLINE vfloat vtanh(vfloat x);
+VEC_INLINE vfloat vtanh_fast(vfloat x);
+VEC_INLINE vfloat vdtanh(vfloat a);
+VEC_INLINE vfloat vrelu(vfloat x);
+VEC_INLINE vfloat vdrelu(vfloat a);
+VEC_INLINE vfloat vleaky_relu(vfloat x);
+VEC_INLINE vfloat vdleaky_relu(vfloat a);
+VEC_INLINE void vepilogue(
+        VecFunc func, VecFunc dfunc,
+        nn_float *out, nn_float *dout, const nn_float *bias, size_t n);
+
+void nn_activation_fast(bool enable)
+{
+    fast_activations = enable;
+}
+
+/*
+ * Layer epilogue: out = f(out + bias) and, when dout is given, dout = f'(out + bias).
+ * Derivatives are taken from the activation value so nothing is computed twice.
+ */
+KERNEL_CLONES
+void nn_activation_epilogue(
+        enum ActivationType type,
+        nn_float *out, nn_float *dout, const nn_float *bias,
+        size_t n)
+{
+    switch (type) {
+    case NN_LINEAR:
+        vepilogue(vlinear, vdlinear, out, dout, bias, n);
+        break;
+    case NN_RELU:
+        vepilogue(vrelu, vdrelu, out, dout, bias, n);
+        break;
+    case NN_LEAKY_RELU:
+        vepilogue(vleaky_relu, vdleaky_relu, out, dout, bias, n);
+        break;
+    case NN_SIGMOID:
+        if (fast_activations) vepilogue(vsigmoid_fast, vdsigmoid, out, dout, bias, n);
+        else vepilogue(vsigmoid, vdsigmoid, out, dout, bias, n);
+        break;
+    case NN_TANH:
+        if (fast_activations) vepilogue(vtanh_fast, vdtanh, out, dout, bias, n);
+        else vepilogue(vtanh, vdtanh, out, dout, bias, n);
+        break;
+    case NN_SOFTPLUS:
+        // softplus' = sigmoid = 1 - exp(-softplus)
+        for (size_t i = 0; i < n; i++) {
+            out[i] = log1p(exp(out[i] + bias[i]));
+            if (dout) dout[i] = -expm1(-out[i]);
+        }
+        break;
+    default:
+        die("nn_activation_epilogue() Error: unknown activation %d", type);
+    }
+}
+
+/* The remainder goes through zero padded vectors so each kernel has a single definition */
+VEC_INLINE void vepilogue(
+        VecFunc func, VecFunc dfunc,
+        nn_float *out, nn_float *dout, const nn_float *bias, size_t n)
+{
+    size_t i;
+    vfloat a;
+
+    for (i = 0; i + VEC_LEN <= n; i += VEC_LEN) {
+        a = func(vload(out + i) + vload(bias + i));
+        vstore(out + i, a);
+        if (dout) vstore(dout + i, dfunc(a));
+    }
+
+    if (i == n) return;
+    nn_float tail[VEC_LEN] = {0}, tail_bias[VEC_LEN] = {0};
+    memcpy(tail, out + i, (n - i) * sizeof(nn_float));
+    memcpy(tail_bias, bias + i, (n - i) * sizeof(nn_float));
+    a = func(vload(tail) + vload(tail_bias));
+    vstore(tail, a);
+    memcpy(out + i, tail, (n - i) * sizeof(nn_float));
+    if (dout) {
+        vstore(tail, dfunc(a));
+        memcpy(dout + i, tail, (n - i) * sizeof(nn_float));
+    }
+}
+
+VEC_INLINE vfloat vload(const nn_float *p)
+{
+    vfloat x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
 
-struct Activation NN_SIGMOID = {
-    .func = sigmoid,
-    .dfunc = dsigmoid
+VEC_INLINE void vstore(nn_float *p, vfloat x)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+VEC_INLINE vfloat vbroadcast(nn_float x)
+{
+    return (vfloat){0} + x;
+}
+
+/* mask lanes are all ones or all zeros, as returned by vector comparisons */
+VEC_INLINE vfloat vselect(vint mask, vfloat a, vfloat b)
+{
+    return (vfloat)(((vint)a & mask) | ((vint)b & ~mask));
+}
+
+/* taylor coefficients of exp from the highest degree */
+static const nn_float EXP_COEFFS[] = {
+    1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0,
+    1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0,
+    1.0 / 24.0, 1.0 / 6.0, 1.0 / 2.0, 1.0, 1.0
 };
 
-struct Activation NN_LINEAR = {
-    .func = linear,
-    .dfunc = dlinear,
+static const nn_float EXP_FAST_COEFFS[] = {
+    1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 1.0 / 2.0, 1.0, 1.0
 };
 
-struct Activation NN_TANH = {
-    .func = tanh,
-    .dfunc = dtanh,
+/* expm1(x) / x taylor coefficients up to x^17 / 18!, enough for |x| <= 1 */
+static const nn_float EXPM1_COEFFS[] = {
+    1.0 / 6402373705728000.0, 1.0 / 355687428096000.0, 1.0 / 20922789888000.0, 1.0 / 1307674368000.0,
+    1.0 / 87178291200.0, 1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0,
+    1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0,
+    1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0,
+    1.0 / 2.0, 1.0 / 1.0
 };
 
-double linear(double x) {return x;}
-double dlinear(double x) {return 1.0;}
+VEC_INLINE vfloat vpoly(vfloat x, const nn_float *coeffs, size_t n)
+{
+    vfloat p = vbroadcast(0);
+    for (size_t i = 0; i < n; i++)
+        p = coeffs[i] + x * p;
+    return p;
+}
+
+/*
+ * exp(x) = 2^k * exp(r), x = k * ln2 + r, |r| <= ln2 / 2
+ * the degree 12 polynomial stays a few ulps from libm, the degree 6 one
+ * has a relative error below 2e-7
+ */
+VEC_INLINE vfloat vexp_poly(vfloat x, const nn_float *coeffs, size_t n)
+{
+    const vfloat shift = vbroadcast(1.5 * ((nn_int)1 << MANT_BITS));
+    vfloat k, r;
+    vint bits;
+
+    x = vselect(x > EXP_MAX, vbroadcast(EXP_MAX), x);
+    x = vselect(x < EXP_MIN, vbroadcast(EXP_MIN), x);
+
+    // round to nearest, k ends up on the low mantissa bits of k + shift
+    k = x * (nn_float)M_LOG2E + shift;
+    bits = (vint)k - (vint)shift;
+    k = k - shift;
+    r = x - k * LN2_HI - k * LN2_LO;
+
+    return vpoly(r, coeffs, n) * (vfloat)((bits + EXP_BIAS) << MANT_BITS);
+}
+
+VEC_INLINE vfloat vexp(vfloat x)
+{
+    return vexp_poly(x, EXP_COEFFS, sizeof(EXP_COEFFS) / sizeof(nn_float));
+}
+
+VEC_INLINE vfloat vexp_fast(vfloat x)
+{
+    return vexp_poly(x, EXP_FAST_COEFFS, sizeof(EXP_FAST_COEFFS) / sizeof(nn_float));
+}
+
+/* near 0 tanh(x) = expm1(2x) / (expm1(2x) + 2) keeps the relative precision */
+VEC_INLINE vfloat vtanh(vfloat x)
+{
+    vfloat u = 2 * x, p, t_small, t_large;
+    vint small = (vint)x & ABS_MASK;
+
+    small = (vfloat)small < 0.5;
+    p = u * vpoly(u, EXPM1_COEFFS, sizeof(EXPM1_COEFFS) / sizeof(nn_float));
+
+    t_small = p / (p + 2);
+    t_large = 1 - 2 / (vexp(u) + 1);
+    return vselect(small, t_small, t_large);
+}
+
+VEC_INLINE vfloat vsigmoid(vfloat x) { return 1 / (1 + vexp(-x)); }
+VEC_INLINE vfloat vsigmoid_fast(vfloat x) { return 1 / (1 + vexp_fast(-x)); }
 
-double sigmoid(double x) { return 1 / (1 + exp(-x)); }
-double dsigmoid(double x) { return sigmoid(x) * (1 - sigmoid(x)); }
+VEC_INLINE vfloat vdsigmoid(vfloat a) { return a * (1 - a); }
 
-double relu(double x) { return (x > 0) ? x : 0; }
-double drelu(double x) { return (x > 0) ? 1 : 0; }
+/* absolute error around 1e-7, it loses relative precision near 0 */
+VEC_INLINE vfloat vtanh_fast(vfloat x) { return 1 - 2 / (vexp_fast(2 * x) + 1); }
+VEC_INLINE vfloat vdtanh(vfloat a) { return 1 - a * a; }
 
-double leaky_relu(double x) { return (x > 0) ? x : 0.01 * x; }
-double dleaky_relu(double x) { return (x > 0) ? 1 : 0.01; }
+VEC_INLINE vfloat vlinear(vfloat x) { return x; }
+VEC_INLINE vfloat vdlinear(vfloat a) { (void)a; return vbroadcast(1); }
 
-double softplus(double x) { return log1p(exp(x)); }
-double dsoftplus(double x) { return sigmoid(x); }
+VEC_INLINE vfloat vrelu(vfloat x) { return vselect(x > 0, x, vbroadcast(0)); }
+VEC_INLINE vfloat vdrelu(vfloat a) { return vselect(a > 0, vbroadcast(1), vbroadcast(0)); }
 
-double dtanh(double x) {return 1 - tanh(x) * tanh(x);};
+VEC_INLINE vfloat vleaky_relu(vfloat x) { return vselect(x > 0, x, (nn_float)0.01 * x); }
+VEC_INLINE vfloat vdleaky_relu(vfloat a) { return vselect(a > 0, vbroadcast(1), vbroadcast(0.01)); }
@@ -0,0 +1,354 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "nn.h"
+#include "blas.h"
+
+#if defined(BLAS_BLIS)
+#include <blis/blis.h>
+#include <blis/cblas.h>
+#define BLAS_LIBRARY "blis"
+#define library_set_threads(n) bli_thread_set_num_threads(n)
+#elif defined(BLAS_CBLAS)
+#include <cblas.h>
+#define BLAS_LIBRARY "cblas"
+#define library_set_threads(n) (void)(n)
+#elif !defined(BLAS_INTERNAL)
+#include <openblas/cblas.h>
+#define BLAS_LIBRARY "openblas"
+#define library_set_threads(n) openblas_set_num_threads(n)
+#endif
+
+#ifdef NN_FLOAT32
+#define cblas_gemm cblas_sgemm
+#define cblas_gemv cblas_sgemv
+#define cblas_ger  cblas_sger
+#else
+#define cblas_gemm cblas_dgemm
+#define cblas_gemv cblas_dgemv
+#define cblas_ger  cblas_dger
+#endif
+
+// internal gemm blocks, a (GEMM_KB x GEMM_NB) block of B stays on cache for all the rows of A
+#define GEMM_KB 128
+#define GEMM_NB 512
+
+// products with k and n up to SMALL_DIM skip the backends, tiny layers cost more in calls than in flops
+#define SMALL_DIM 32
+#define SMALL_ROWS 4
+
+#define VEC_LEN (VEC_BYTES / sizeof(nn_float))
+
+typedef nn_float vfloat __attribute__((vector_size(VEC_BYTES)));
+
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+struct BlasOps {
+    const char *name;
+    void (*gemm)(size_t, size_t, size_t, nn_float, const nn_float *, size_t,
+                 const nn_float *, size_t, nn_float, nn_float *, size_t);
+    void (*gemv)(size_t, size_t, nn_float, const nn_float *, size_t,
+                 const nn_float *, nn_float, nn_float *);
+    void (*ger)(size_t, size_t, nn_float, const nn_float *, const nn_float *,
+                nn_float *, size_t);
+};
+
+static void internal_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc);
+static void internal_gemv(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *x,
+        nn_float beta, nn_float *y);
+static void internal_ger(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *x, const nn_float *y,
+        nn_float *a, size_t lda);
+static void small_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc);
+static inline __attribute__((always_inline)) void small_gemm_rows(
+        size_t rows, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc);
+static inline __attribute__((always_inline)) void axpy(size_t n, nn_float alpha, const nn_float *x, nn_float *y);
+static inline __attribute__((always_inline)) nn_float dot(size_t n, const nn_float *x, const nn_float *y);
+
+#ifdef BLAS_LIBRARY
+static void library_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc);
+static void library_gemv(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *x,
+        nn_float beta, nn_float *y);
+static void library_ger(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *x, const nn_float *y,
+        nn_float *a, size_t lda);
+#endif
+
+static const struct BlasOps backends[] = {
+#ifdef BLAS_LIBRARY
+    {BLAS_LIBRARY, library_gemm, library_gemv, library_ger},
+#endif
+    {"internal", internal_gemm, internal_gemv, internal_ger},
+};
+
+static const struct BlasOps *blas = &backends[0];
+
+/* backend NULL keeps the default (the linked library), threads <= 0 keeps the library threads */
+void blas_init(const char *backend, int threads)
+{
+    if (backend) {
+        size_t i, n_backends = sizeof(backends) / sizeof(backends[0]);
+        for (i = 0; i < n_backends && strcmp(backend, backends[i].name); i++);
+        if (i == n_backends) die("blas_init() Error: '%s' backend is not available on this build", backend);
+        blas = &backends[i];
+    }
+
+#ifdef BLAS_LIBRARY
+    if (threads > 0) library_set_threads(threads);
+#else
+    (void)threads;
+#endif
+}
+
+const char *blas_backend_name(size_t i)
+{
+    return (i < sizeof(backends) / sizeof(backends[0])) ? backends[i].name : NULL;
+}
+
+void blas_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc)
+{
+    if (n <= SMALL_DIM && k <= SMALL_DIM) small_gemm(m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+    else blas->gemm(m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+}
+
+void blas_gemv(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *x,
+        nn_float beta, nn_float *y)
+{
+    if (m <= SMALL_DIM && n <= SMALL_DIM) internal_gemv(m, n, alpha, a, lda, x, beta, y);
+    else blas->gemv(m, n, alpha, a, lda, x, beta, y);
+}
+
+void blas_ger(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *x, const nn_float *y,
+        nn_float *a, size_t lda)
+{
+    if (m <= SMALL_DIM && n <= SMALL_DIM) internal_ger(m, n, alpha, x, y, a, lda);
+    else blas->ger(m, n, alpha, x, y, a, lda);
+}
+
+#ifdef BLAS_LIBRARY
+void library_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc)
+{
+    cblas_gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k,
+               alpha, a, lda, b, ldb, beta, c, ldc);
+}
+
+void library_gemv(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *x,
+        nn_float beta, nn_float *y)
+{
+    cblas_gemv(CblasRowMajor, CblasNoTrans, m, n, alpha, a, lda, x, 1, beta, y, 1);
+}
+
+void library_ger(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *x, const nn_float *y,
+        nn_float *a, size_t lda)
+{
+    cblas_ger(CblasRowMajor, m, n, alpha, x, 1, y, 1, a, lda);
+}
+#endif
+
+KERNEL_CLONES
+void internal_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc)
+{
+    for (size_t i = 0; i < m; i++) {
+        nn_float *c_row = c + i * ldc;
+        if (beta == 0) memset(c_row, 0, n * sizeof(nn_float));
+        else if (beta != 1) for (size_t j = 0; j < n; j++) c_row[j] *= beta;
+    }
+
+    for (size_t jj = 0; jj < n; jj += GEMM_NB) {
+        size_t nb = (n - jj < GEMM_NB) ? n - jj : GEMM_NB;
+        for (size_t pp = 0; pp < k; pp += GEMM_KB) {
+            size_t kb = (k - pp < GEMM_KB) ? k - pp : GEMM_KB;
+            for (size_t i = 0; i < m; i++) {
+                const nn_float *a_row = a + i * lda + pp;
+                nn_float *c_row = c + i * ldc + jj;
+                for (size_t p = 0; p < kb; p++)
+                    axpy(nb, alpha * a_row[p], b + (pp + p) * ldb + jj, c_row);
+            }
+        }
+    }
+}
+
+KERNEL_CLONES
+void internal_gemv(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *x,
+        nn_float beta, nn_float *y)
+{
+    for (size_t i = 0; i < m; i++) {
+        nn_float sum = alpha * dot(n, a + i * lda, x);
+        y[i] = (beta == 0) ? sum : beta * y[i] + sum;
+    }
+}
+
+KERNEL_CLONES
+void internal_ger(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *x, const nn_float *y,
+        nn_float *a, size_t lda)
+{
+    for (size_t i = 0; i < m; i++)
+        axpy(n, alpha * x[i], y, a + i * lda);
+}
+
+/*
+ * The C rows are accumulated on registers SMALL_ROWS at a time, widths up to
+ * 16 get their own copy of the kernel with n known so the loops unroll fully.
+ */
+KERNEL_CLONES
+void small_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc)
+{
+    for (size_t i = 0; i < m; i += SMALL_ROWS) {
+        size_t rows = (m - i < SMALL_ROWS) ? m - i : SMALL_ROWS;
+        const nn_float *a_rows = a + i * lda;
+        nn_float *c_rows = c + i * ldc;
+
+#define SMALL_CASE(N) case N: small_gemm_rows(rows, N, k, alpha, a_rows, lda, b, ldb, beta, c_rows, ldc); break;
+        switch (n) {
+        SMALL_CASE(1)  SMALL_CASE(2)  SMALL_CASE(3)  SMALL_CASE(4)
+        SMALL_CASE(5)  SMALL_CASE(6)  SMALL_CASE(7)  SMALL_CASE(8)
+        SMALL_CASE(9)  SMALL_CASE(10) SMALL_CASE(11) SMALL_CASE(12)
+        SMALL_CASE(13) SMALL_CASE(14) SMALL_CASE(15) SMALL_CASE(16)
+        default: small_gemm_rows(rows, n, k, alpha, a_rows, lda, b, ldb, beta, c_rows, ldc);
+        }
+#undef SMALL_CASE
+    }
+}
+
+void small_gemm_rows(
+        size_t rows, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc)
+{
+    nn_float acc[SMALL_ROWS][SMALL_DIM];
+
+    if (rows == SMALL_ROWS) {
+        for (size_t r = 0; r < SMALL_ROWS; r++)
+            for (size_t j = 0; j < n; j++) acc[r][j] = 0;
+
+        for (size_t p = 0; p < k; p++) {
+            const nn_float *b_row = b + p * ldb;
+            nn_float a0 = a[p], a1 = a[lda + p], a2 = a[2 * lda + p], a3 = a[3 * lda + p];
+            for (size_t j = 0; j < n; j++) {
+                acc[0][j] += a0 * b_row[j];
+                acc[1][j] += a1 * b_row[j];
+                acc[2][j] += a2 * b_row[j];
+                acc[3][j] += a3 * b_row[j];
+            }
+        }
+    } else {
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t j = 0; j < n; j++) acc[r][j] = 0;
+            for (size_t p = 0; p < k; p++) {
+                const nn_float *b_row = b + p * ldb;
+                for (size_t j = 0; j < n; j++) acc[r][j] += a[r * lda + p] * b_row[j];
+            }
+        }
+    }
+
+    for (size_t r = 0; r < rows; r++) {
+        nn_float *c_row = c + r * ldc;
+        if (beta == 0) for (size_t j = 0; j < n; j++) c_row[j] = alpha * acc[r][j];
+        else for (size_t j = 0; j < n; j++) c_row[j] = alpha * acc[r][j] + beta * c_row[j];
+    }
+}
+
+/* y = y + alpha * x */
+void axpy(size_t n, nn_float alpha, const nn_float *x, nn_float *y)
+{
+    size_t j = 0;
+    for (; j + VEC_LEN <= n; j += VEC_LEN) {
+        vfloat vx, vy;
+        memcpy(&vx, x + j, sizeof(vx));
+        memcpy(&vy, y + j, sizeof(vy));
+        vy += alpha * vx;
+        memcpy(y + j, &vy, sizeof(vy));
+    }
+    for (; j < n; j++) y[j] += alpha * x[j];
+}
+
+nn_float dot(size_t n, const nn_float *x, const nn_float *y)
+{
+    vfloat acc = {0};
+    nn_float sum = 0;
+    size_t j = 0;
+
+    for (; j + VEC_LEN <= n; j += VEC_LEN) {
+        vfloat vx, vy;
+        memcpy(&vx, x + j, sizeof(vx));
+        memcpy(&vy, y + j, sizeof(vy));
+        acc += vx * vy;
+    }
+    for (size_t l = 0; l < VEC_LEN; l++) sum += acc[l];
+    for (; j < n; j++) sum += x[j] * y[j];
+    return sum;
+}
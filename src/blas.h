@@ -0,0 +1,56 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BLAS__
+#define __BLAS__
+
+#include <stddef.h>
+
+#include "util.h"
+
+/*
+ * Row major products used by the network. The build links one CBLAS library
+ * (make BLAS=openblas|blis|cblas) or none (BLAS=internal), the internal
+ * kernels are always there and blas_init() picks either of them at runtime.
+ * Products small enough for call overhead to dominate always run internally.
+ */
+
+void blas_init(const char *backend, int threads);
+/* name of backend i, NULL past the last one */
+const char *blas_backend_name(size_t i);
+
+/* C = alpha * A @ B + beta * C, A is (m x k) and B (k x n) */
+void blas_gemm(
+        size_t m, size_t n, size_t k,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *b, size_t ldb,
+        nn_float beta, nn_float *c, size_t ldc);
+
+/* y = alpha * A @ x + beta * y, A is (m x n) */
+void blas_gemv(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *a, size_t lda,
+        const nn_float *x,
+        nn_float beta, nn_float *y);
+
+/* A = A + alpha * x @ y.T, A is (m x n) */
+void blas_ger(
+        size_t m, size_t n,
+        nn_float alpha, const nn_float *x, const nn_float *y,
+        nn_float *a, size_t lda);
+#endif
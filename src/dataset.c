@@ -0,0 +1,232 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "nn.h"
+#include "parse.h"
+#include "dataset.h"
+
+#define HEADER_SIZE (4 + sizeof(uint32_t) + 3 * sizeof(size_t))
+
+static void write_header(Dataset *ds);
+static uint64_t hash_string(uint64_t hash, const char *string);
+static uint64_t hash_fields(uint64_t hash, char **keys, size_t n_keys, struct Configs cfg);
+
+void dataset_create(Dataset *ds, char *filepath, size_t in_cols, size_t out_cols, uint64_t layout)
+{
+    ds->fp = fopen(filepath, "wb");
+    if (ds->fp == NULL) die("dataset_create() Error:");
+
+    ds->rows = 0;
+    ds->in_cols = in_cols;
+    ds->out_cols = out_cols;
+    ds->dtype = sizeof(nn_float);
+    ds->layout = layout;
+    ds->writing = true;
+    write_header(ds);
+}
+
+/* write the rows of X and y at the end of the file */
+void dataset_append(Dataset *ds, Tensor *X, Tensor *y)
+{
+    if (X->shape[0] != y->shape[0] || X->shape[1] != ds->in_cols || y->shape[1] != ds->out_cols) {
+        die("dataset_append() Error: (%zu x %zu) and (%zu x %zu) rows do not match a (%zu, %zu) columns dataset",
+            X->shape[0], X->shape[1], y->shape[0], y->shape[1], ds->in_cols, ds->out_cols);
+    }
+
+    for (size_t i = 0; i < X->shape[0]; i++) {
+        if (fwrite(TENSOR_ROW(*X, i), sizeof(nn_float), ds->in_cols, ds->fp) != ds->in_cols
+            || fwrite(TENSOR_ROW(*y, i), sizeof(nn_float), ds->out_cols, ds->fp) != ds->out_cols) {
+            die("dataset_append() Error:");
+        }
+    }
+    ds->rows += X->shape[0];
+}
+
+void dataset_open(Dataset *ds, char *filepath)
+{
+    char magic[4];
+
+    ds->fp = fopen(filepath, "rb");
+    if (ds->fp == NULL) die("dataset_open() Error:");
+    ds->writing = false;
+
+    if (fread(magic, 1, 4, ds->fp) != 4 || memcmp(magic, DATASET_MAGIC, 4)
+        || fread(&ds->dtype, sizeof(uint32_t), 1, ds->fp) != 1
+        || fread(&ds->rows, sizeof(size_t), 1, ds->fp) != 1
+        || fread(&ds->in_cols, sizeof(size_t), 1, ds->fp) != 1
+        || fread(&ds->out_cols, sizeof(size_t), 1, ds->fp) != 1) {
+        goto dataset_open_error;
+    }
+
+    ds->layout = 0;
+    if (ds->dtype & DATASET_LAYOUT) {
+        ds->dtype &= ~DATASET_LAYOUT;
+        if (fread(&ds->layout, sizeof(uint64_t), 1, ds->fp) != 1) goto dataset_open_error;
+    }
+    if (ds->dtype != sizeof(float) && ds->dtype != sizeof(double)) goto dataset_open_error;
+    return;
+
+dataset_open_error:
+    fclose(ds->fp);
+    die("dataset_open() Error: '%s' is not a dataset file", filepath);
+}
+
+/* Fill the first rows of X and y with rows [start, start + rows) of the file */
+void dataset_read(Dataset *ds, size_t start, size_t rows, Tensor *X, Tensor *y)
+{
+    if (start + rows > ds->rows) {
+        die("dataset_read() Error: rows [%zu, %zu) are out of a %zu rows dataset", start, start + rows, ds->rows);
+    }
+    if (rows > X->shape[0] || rows > y->shape[0]) {
+        die("dataset_read() Error: %zu rows do not fit on the output tensors", rows);
+    }
+
+    off_t offset = HEADER_SIZE + ((ds->layout) ? sizeof(uint64_t) : 0) + (off_t)(start * (ds->in_cols + ds->out_cols) * ds->dtype);
+    if (fseeko(ds->fp, offset, SEEK_SET) == -1) die("dataset_read() Error:");
+
+    for (size_t i = 0; i < rows; i++) {
+        if (nn_read_values(ds->fp, TENSOR_ROW(*X, i), ds->in_cols, ds->dtype) != ds->in_cols
+            || nn_read_values(ds->fp, TENSOR_ROW(*y, i), ds->out_cols, ds->dtype) != ds->out_cols) {
+            die("dataset_read() Error: unexpected end of file on row %zu", start + i);
+        }
+    }
+}
+
+void dataset_close(Dataset *ds)
+{
+    if (ds->writing) {
+        rewind(ds->fp);
+        write_header(ds);
+    }
+    if (fclose(ds->fp) == EOF) die("dataset_close() Error:");
+    ds->fp = NULL;
+}
+
+/* Swap every row of inputs and labels with a random one */
+void dataset_shuffle_rows(Tensor *inputs, Tensor *labels)
+{
+    size_t random_row;
+    size_t column_in_bytes, column_lbl_bytes;
+    nn_float *in_buffer, *lbl_buffer;
+
+    in_buffer = malloc(sizeof(nn_float) * inputs->shape[1]);
+    lbl_buffer = malloc(sizeof(nn_float) * labels->shape[1]);
+
+    if (in_buffer == NULL || lbl_buffer == NULL)
+        goto dataset_shuffle_rows_error;
+
+    column_in_bytes = sizeof(nn_float) * inputs->shape[1];
+    column_lbl_bytes = sizeof(nn_float) * labels->shape[1];
+    for (size_t row = 0; row < inputs->shape[0]; row++) {
+        /* Swap actual row with a random row*/
+        random_row = random() % inputs->shape[0];
+
+        /* Input Swap */
+        memcpy(in_buffer, TENSOR_ROW(*inputs, row), column_in_bytes);
+        memcpy(TENSOR_ROW(*inputs, row), TENSOR_ROW(*inputs, random_row), column_in_bytes);
+        memcpy(TENSOR_ROW(*inputs, random_row), in_buffer, column_in_bytes);
+
+        /* Label Swap */
+        memcpy(lbl_buffer, TENSOR_ROW(*labels, row), column_lbl_bytes);
+        memcpy(TENSOR_ROW(*labels, row), TENSOR_ROW(*labels, random_row), column_lbl_bytes);
+        memcpy(TENSOR_ROW(*labels, random_row), lbl_buffer, column_lbl_bytes);
+
+    }
+
+    free(in_buffer);
+    free(lbl_buffer);
+    return;
+
+dataset_shuffle_rows_error:
+    die("dataset_shuffle_rows() malloc Error:");
+}
+
+void write_header(Dataset *ds)
+{
+    uint32_t dtype = ds->dtype | DATASET_LAYOUT;
+
+    if (fwrite(DATASET_MAGIC, 1, 4, ds->fp) != 4
+        || fwrite(&dtype, sizeof(uint32_t), 1, ds->fp) != 1
+        || fwrite(&ds->rows, sizeof(size_t), 1, ds->fp) != 1
+        || fwrite(&ds->in_cols, sizeof(size_t), 1, ds->fp) != 1
+        || fwrite(&ds->out_cols, sizeof(size_t), 1, ds->fp) != 1
+        || fwrite(&ds->layout, sizeof(uint64_t), 1, ds->fp) != 1) {
+        die("dataset write_header() Error:");
+    }
+}
+
+/* FNV-1a of the input and label fields in order, with the values of the onehot ones */
+uint64_t dataset_layout(struct Configs cfg)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+
+    hash = hash_fields(hash_string(hash, "inputs"), cfg.input_keys, cfg.n_input_keys, cfg);
+    hash = hash_fields(hash_string(hash, "labels"), cfg.label_keys, cfg.n_label_keys, cfg);
+    return (hash) ? hash : 1;
+}
+
+/* Die when the dataset was not preprocessed with the fields of cfg */
+void dataset_check(Dataset *ds, char *filepath, struct Configs cfg)
+{
+    Array in = {0}, out = {0};
+    size_t in_cols, out_cols;
+
+    array_set_fields(&in, cfg.input_keys, cfg.n_input_keys, cfg);
+    array_set_fields(&out, cfg.label_keys, cfg.n_label_keys, cfg);
+    in_cols = array_width(in);
+    out_cols = array_width(out);
+    array_free(&in);
+    array_free(&out);
+
+    if (ds->in_cols != in_cols || ds->out_cols != out_cols) {
+        die("dataset_check() Error: '%s' has %zu inputs and %zu labels, the config fields take %zu and %zu",
+            filepath, ds->in_cols, ds->out_cols, in_cols, out_cols);
+    }
+    if (ds->layout && ds->layout != dataset_layout(cfg)) {
+        die("dataset_check() Error: '%s' was preprocessed with other inputs or labels", filepath);
+    }
+}
+
+uint64_t hash_string(uint64_t hash, const char *string)
+{
+    do {
+        hash ^= (unsigned char)*string;
+        hash *= UINT64_C(1099511628211);
+    } while (*string++);
+    return hash;
+}
+
+uint64_t hash_fields(uint64_t hash, char **keys, size_t n_keys, struct Configs cfg)
+{
+    for (size_t j = 0; j < n_keys; j++) {
+        hash = hash_string(hash, keys[j]);
+        if (util_get_key_index(keys[j], cfg.onehot_keys, cfg.n_onehot_keys) == -1) continue;
+
+        int k = util_get_key_index(keys[j], cfg.categorical_keys, cfg.n_categorical_keys);
+        if (k == -1) continue;
+        for (size_t v = 0; v < cfg.n_categorical_values[k]; v++) hash = hash_string(hash, cfg.categorical_values[k][v]);
+    }
+    return hash;
+}
@@ -0,0 +1,57 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DATASET__
+#define __DATASET__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "tensor.h"
+
+#define DATASET_MAGIC "MLDS"
+#define DATASET_LAYOUT 0x100 // dtype flag of the files with a layout hash
+
+/*
+ * Preprocessed dataset file (`ml preprocess`), read by row ranges so training
+ * does not need the whole data on memory. The header is DATASET_MAGIC, the
+ * size of the values (4 or 8) and the rows, input and label columns, newer
+ * files follow it with a hash of the config fields they were made with. Then
+ * every row stores its inputs followed by its labels.
+ */
+typedef struct Dataset {
+    FILE *fp;
+    size_t rows;
+    size_t in_cols;
+    size_t out_cols;
+    uint32_t dtype;
+    uint64_t layout;    /* 0 on files without it */
+    bool writing;
+} Dataset;
+
+void dataset_create(Dataset *ds, char *filepath, size_t in_cols, size_t out_cols, uint64_t layout);
+void dataset_append(Dataset *ds, Tensor *X, Tensor *y);
+void dataset_open(Dataset *ds, char *filepath);
+uint64_t dataset_layout(struct Configs cfg);
+void dataset_check(Dataset *ds, char *filepath, struct Configs cfg);
+void dataset_read(Dataset *ds, size_t start, size_t rows, Tensor *X, Tensor *y);
+void dataset_close(Dataset *ds);
+void dataset_shuffle_rows(Tensor *inputs, Tensor *labels);
+#endif
@@ -0,0 +1,189 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "nn.h"
+#include "pool.h"
+#include "ensemble.h"
+
+struct Job {
+    Ensemble *ensemble;
+    Tensor *outs, *input;
+    Sparse *sparse_input;
+};
+
+static Layer *load_model(char *filepath, struct Configs cfg, size_t *in_cols);
+static void expand_labels(Ensemble *ensemble, struct Configs cfg);
+static void predict_model(void *arg, size_t model);
+
+void ensemble_load(Ensemble *ensemble, struct Configs cfg)
+{
+    char **filepaths = (cfg.n_weights_filepaths) ? cfg.weights_filepaths : &cfg.weights_filepath;
+
+    if (!filepaths[0]) die("ensemble_load() Error: weights_path is not defined");
+
+    ensemble->n_models = (cfg.n_weights_filepaths) ? cfg.n_weights_filepaths : 1;
+    ensemble->each = cfg.each_model && ensemble->n_models > 1;
+    ensemble->networks = ecalloc(ensemble->n_models, sizeof(Layer *));
+    for (size_t m = 0; m < ensemble->n_models; m++) {
+        size_t in_cols;
+        ensemble->networks[m] = load_model(filepaths[m], cfg, &in_cols);
+        if (m > 0 && in_cols != ensemble->in_cols) {
+            die("ensemble_load() Error: '%s' takes %zu inputs, '%s' takes %zu",
+                filepaths[m], in_cols, filepaths[0], ensemble->in_cols);
+        }
+        ensemble->in_cols = in_cols;
+    }
+
+    ensemble->cfg = cfg;
+    ensemble->out_cols = cfg.neurons[cfg.network_size - 1];
+    if (ensemble->each) {
+        ensemble->out_cols *= ensemble->n_models;
+        expand_labels(ensemble, cfg);
+    }
+}
+
+/* out gets out_cols columns, a single model writes straight on it */
+void ensemble_predict(Ensemble *ensemble, Tensor *out, Tensor *input, Sparse *sparse_input)
+{
+    size_t n_models = ensemble->n_models, network_size = ensemble->cfg.network_size;
+    size_t rows = input->shape[0], cols = ensemble->networks[0][network_size - 1].neurons;
+
+    if (n_models == 1) {
+        nn_network_predict(out, input, sparse_input, ensemble->networks[0], network_size);
+        return;
+    }
+
+    struct Job job = {.ensemble = ensemble, .input = input, .sparse_input = sparse_input};
+    job.outs = ecalloc(n_models, sizeof(Tensor));
+    for (size_t m = 0; m < n_models; m++) job.outs[m] = tensor_alloc(rows, cols);
+
+    pool_run(ensemble->cfg, n_models, predict_model, &job);
+
+    for (size_t i = 0; i < rows; i++) {
+        nn_float *row = TENSOR_ROW(*out, i);
+        if (ensemble->each) {
+            for (size_t m = 0; m < n_models; m++) {
+                memcpy(row + m * cols, TENSOR_ROW(job.outs[m], i), cols * sizeof(nn_float));
+            }
+            continue;
+        }
+        for (size_t j = 0; j < cols; j++) {
+            double sum = 0;
+            for (size_t m = 0; m < n_models; m++) sum += TENSOR_ROW(job.outs[m], i)[j];
+            row[j] = sum / n_models;
+        }
+    }
+
+    for (size_t m = 0; m < n_models; m++) tensor_free(&job.outs[m]);
+    free(job.outs);
+}
+
+void ensemble_free(Ensemble *ensemble)
+{
+    for (size_t m = 0; m < ensemble->n_models; m++) {
+        nn_network_free_weights(ensemble->networks[m], ensemble->cfg.network_size);
+        free(ensemble->networks[m]);
+    }
+    free(ensemble->networks);
+
+    if (!ensemble->each) return;
+    for (size_t j = 0; j < ensemble->cfg.n_label_keys; j++) free(ensemble->cfg.label_keys[j]);
+    free(ensemble->cfg.label_keys);
+    free(ensemble->cfg.onehot_keys);
+    free(ensemble->cfg.categorical_keys);
+    free(ensemble->cfg.categorical_values);
+    free(ensemble->cfg.n_categorical_values);
+}
+
+/* Network with the input and layer widths of the weights file */
+Layer *load_model(char *filepath, struct Configs cfg, size_t *in_cols)
+{
+    size_t *neurons, network_size = nn_network_read_layers(filepath, &neurons);
+    size_t labels = cfg.neurons[cfg.network_size - 1];
+
+    if (network_size != cfg.network_size) {
+        die("ensemble_load() Error: '%s' has %zu layers, the config file has %zu",
+            filepath, network_size, cfg.network_size);
+    }
+    if (neurons[network_size - 1] != labels) {
+        die("ensemble_load() Error: '%s' has %zu outputs, the labels need %zu",
+            filepath, neurons[network_size - 1], labels);
+    }
+
+    cfg.neurons = neurons;
+    Layer *network = load_network(cfg);
+    *in_cols = nn_network_read_input_nodes(filepath);
+    if (nn_network_is_int8(filepath)) nn_network_init_bias(network, network_size, *in_cols);
+    else nn_network_init_weights(network, network_size, *in_cols, false);
+    nn_network_read_weights(filepath, network, network_size);
+    nn_network_sparsify(network, network_size, cfg.sparse_density);
+    free(neurons);
+    return network;
+}
+
+/* label fields of every model, onehot ones share the values of their label */
+void expand_labels(Ensemble *ensemble, struct Configs cfg)
+{
+    struct Configs *out = &ensemble->cfg;
+    size_t n_labels = cfg.n_label_keys, n_keys = n_labels * ensemble->n_models;
+
+    out->label_keys = ecalloc(n_keys, sizeof(char *));
+    out->onehot_keys = ecalloc(cfg.n_onehot_keys + n_keys, sizeof(char *));
+    out->categorical_keys = ecalloc(cfg.n_categorical_keys + n_keys, sizeof(char *));
+    out->categorical_values = ecalloc(cfg.n_categorical_keys + n_keys, sizeof(char **));
+    out->n_categorical_values = ecalloc(cfg.n_categorical_keys + n_keys, sizeof(size_t));
+    if (cfg.n_onehot_keys) memcpy(out->onehot_keys, cfg.onehot_keys, cfg.n_onehot_keys * sizeof(char *));
+    if (cfg.n_categorical_keys) {
+        memcpy(out->categorical_keys, cfg.categorical_keys, cfg.n_categorical_keys * sizeof(char *));
+        memcpy(out->categorical_values, cfg.categorical_values, cfg.n_categorical_keys * sizeof(char **));
+        memcpy(out->n_categorical_values, cfg.n_categorical_values, cfg.n_categorical_keys * sizeof(size_t));
+    }
+    out->n_label_keys = n_keys;
+
+    for (size_t m = 0; m < ensemble->n_models; m++) {
+        for (size_t j = 0; j < n_labels; j++) {
+            char *label = cfg.label_keys[j];
+            size_t size = strlen(label) + 24;
+            char *key = ecalloc(size, sizeof(char));
+
+            snprintf(key, size, "%s.%zu", label, m);
+            out->label_keys[m * n_labels + j] = key;
+            if (util_get_key_index(label, cfg.onehot_keys, cfg.n_onehot_keys) == -1) continue;
+
+            int k = util_get_key_index(label, cfg.categorical_keys, cfg.n_categorical_keys);
+            out->onehot_keys[out->n_onehot_keys++] = key;
+            out->categorical_keys[out->n_categorical_keys] = key;
+            out->categorical_values[out->n_categorical_keys] = cfg.categorical_values[k];
+            out->n_categorical_values[out->n_categorical_keys++] = cfg.n_categorical_values[k];
+        }
+    }
+}
+
+void predict_model(void *arg, size_t model)
+{
+    struct Job *job = arg;
+    Ensemble *ensemble = job->ensemble;
+
+    nn_network_predict(&job->outs[model], job->input, job->sparse_input,
+                       ensemble->networks[model], ensemble->cfg.network_size);
+}
@@ -0,0 +1,48 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ENSEMBLE__
+#define __ENSEMBLE__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+#include "tensor.h"
+#include "nn.h"
+
+/*
+ * Networks predicting over the same input, one per weights file given with -w
+ * (weights_path otherwise). The layer widths are read from each file and the
+ * activations from the config. Predictions are the mean of the models outputs
+ * or, with each set, the outputs of every model side by side; cfg then names
+ * the label fields of model i as "<label>.<i>".
+ */
+typedef struct Ensemble {
+    Layer **networks;
+    size_t n_models;
+    size_t in_cols;     /* input width, the same on every model */
+    size_t out_cols;    /* prediction columns */
+    bool each;
+    struct Configs cfg; /* configs of the output fields */
+} Ensemble;
+
+void ensemble_load(Ensemble *ensemble, struct Configs cfg);
+void ensemble_predict(Ensemble *ensemble, Tensor *out, Tensor *input, Sparse *sparse_input);
+void ensemble_free(Ensemble *ensemble);
+#endif
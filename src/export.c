@@ -0,0 +1,167 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "nn.h"
+
+/*
+ * C source export. The generated file only needs libm: weights are static
+ * const arrays and the forward pass has every size and activation fixed, so
+ * the compiler can specialize it. Layers up to UNROLL_MAX products are
+ * written out one neuron per statement, bigger ones as constant bound loops.
+ */
+
+#define UNROLL_MAX 256
+
+#ifdef NN_FLOAT32
+#define EXPORT_TYPE "float"
+#define EXPORT_DIGITS 9
+#else
+#define EXPORT_TYPE "double"
+#define EXPORT_DIGITS 17
+#endif
+
+static void write_columns(FILE *fp, char **keys, size_t n_keys, struct Configs cfg);
+static void write_values(FILE *fp, const char *name, const nn_float *values, size_t n);
+static void write_layer(FILE *fp, Layer layer, size_t l, const char *in, const char *out);
+static const char *activation_name(enum ActivationType type);
+
+void nn_network_export_c(char *filepath, Layer network[], size_t network_size, struct Configs cfg)
+{
+    size_t l;
+    bool used[NN_TANH + 1] = {0}, loops = false;
+    char in[32], out[32];
+
+    for (l = 0; l < network_size; l++) {
+        if (!network[l].weights) die("nn_network_export_c() Error: only float weights can be exported");
+        used[network[l].activation] = true;
+        loops |= network[l].input_nodes * network[l].neurons > UNROLL_MAX;
+    }
+
+    FILE *fp = (strcmp(filepath, "-")) ? fopen(filepath, "w") : fopen("/dev/stdout", "w");
+    if (fp == NULL) die("nn_network_export_c() Error:");
+
+    fprintf(fp, "/*\n * Generated by `ml export-c` from %s\n *\n", cfg.in_filepath);
+    fprintf(fp, " * inputs:");
+    write_columns(fp, cfg.input_keys, cfg.n_input_keys, cfg);
+    fprintf(fp, "\n * outputs:");
+    write_columns(fp, cfg.label_keys, cfg.n_label_keys, cfg);
+    fprintf(fp, "\n */\n\n#include <math.h>\n\n");
+    fprintf(fp, "#define ML_INPUTS %zu\n#define ML_OUTPUTS %zu\n\n", network[0].input_nodes, network[network_size - 1].neurons);
+    fprintf(fp, "typedef %s ml_float;\n\n", EXPORT_TYPE);
+
+    for (l = 0; l < network_size; l++) {
+        sprintf(in, "ml_w%zu", l);
+        write_values(fp, in, network[l].weights, network[l].input_nodes * network[l].neurons);
+        sprintf(in, "ml_b%zu", l);
+        write_values(fp, in, network[l].bias, network[l].neurons);
+    }
+
+    if (used[NN_RELU])          fprintf(fp, "static inline ml_float ml_relu(ml_float x) { return x > 0 ? x : 0; }\n");
+    if (used[NN_LEAKY_RELU])    fprintf(fp, "static inline ml_float ml_leaky_relu(ml_float x) { return x > 0 ? x : (ml_float)0.01 * x; }\n");
+    if (used[NN_SIGMOID])       fprintf(fp, "static inline ml_float ml_sigmoid(ml_float x) { return 1 / (1 + exp(-x)); }\n");
+    if (used[NN_SOFTPLUS])      fprintf(fp, "static inline ml_float ml_softplus(ml_float x) { return log1p(exp(x)); }\n");
+    if (used[NN_TANH])          fprintf(fp, "static inline ml_float ml_tanh(ml_float x) { return tanh(x); }\n");
+    if (used[NN_LINEAR])        fprintf(fp, "static inline ml_float ml_linear(ml_float x) { return x; }\n");
+
+    fprintf(fp, "\n/* out = network(x), x is a row of preprocessed inputs (onehot fields expanded) */\n");
+    fprintf(fp, "void ml_predict(const ml_float x[ML_INPUTS], ml_float out[ML_OUTPUTS])\n{\n");
+    for (l = 0; l + 1 < network_size; l++) fprintf(fp, "    ml_float h%zu[%zu];\n", l, network[l].neurons);
+    if (loops) fprintf(fp, "    int i, j;\n");
+
+    for (l = 0; l < network_size; l++) {
+        if (l == 0) strcpy(in, "x");
+        else sprintf(in, "h%zu", l - 1);
+        if (l == network_size - 1) strcpy(out, "out");
+        else sprintf(out, "h%zu", l);
+        write_layer(fp, network[l], l, in, out);
+    }
+    fprintf(fp, "}\n");
+
+    if (fclose(fp) == EOF) die("nn_network_export_c() Error:");
+}
+
+/* design matrix column names, onehot fields get one column per value */
+void write_columns(FILE *fp, char **keys, size_t n_keys, struct Configs cfg)
+{
+    for (size_t j = 0; j < n_keys; j++) {
+        int k = -1;
+        if (util_get_key_index(keys[j], cfg.onehot_keys, cfg.n_onehot_keys) != -1) {
+            k = util_get_key_index(keys[j], cfg.categorical_keys, cfg.n_categorical_keys);
+        }
+        if (k == -1) {
+            fprintf(fp, " %s", keys[j]);
+            continue;
+        }
+        for (size_t v = 0; v < cfg.n_categorical_values[k]; v++) {
+            fprintf(fp, " %s=%s", keys[j], cfg.categorical_values[k][v]);
+        }
+    }
+}
+
+void write_values(FILE *fp, const char *name, const nn_float *values, size_t n)
+{
+    fprintf(fp, "static const ml_float %s[%zu] = {", name, n);
+    for (size_t i = 0; i < n; i++) {
+        if (i % 4 == 0) fprintf(fp, "\n   ");
+        fprintf(fp, " %.*g,", EXPORT_DIGITS, (double)values[i]);
+    }
+    fprintf(fp, "\n};\n\n");
+}
+
+/* out = activation(in @ W + b), W is (input_nodes x neurons) row major */
+void write_layer(FILE *fp, Layer layer, size_t l, const char *in, const char *out)
+{
+    size_t rows = layer.input_nodes, cols = layer.neurons;
+    const char *act = activation_name(layer.activation);
+
+    fprintf(fp, "\n    /* layer %zu: %zu -> %zu %s */\n", l, rows, cols, act);
+    if (rows * cols <= UNROLL_MAX) {
+        for (size_t j = 0; j < cols; j++) {
+            fprintf(fp, "    %s[%zu] = ml_%s(ml_b%zu[%zu]", out, j, act, l, j);
+            for (size_t i = 0; i < rows; i++) {
+                fprintf(fp, "\n            + %s[%zu] * ml_w%zu[%zu]", in, i, l, i * cols + j);
+            }
+            fprintf(fp, ");\n");
+        }
+        return;
+    }
+
+    fprintf(fp, "    for (j = 0; j < %zu; j++) %s[j] = ml_b%zu[j];\n", cols, out, l);
+    fprintf(fp, "    for (i = 0; i < %zu; i++)\n", rows);
+    fprintf(fp, "        for (j = 0; j < %zu; j++) %s[j] += %s[i] * ml_w%zu[i * %zu + j];\n", cols, out, in, l, cols);
+    fprintf(fp, "    for (j = 0; j < %zu; j++) %s[j] = ml_%s(%s[j]);\n", cols, out, act, out);
+}
+
+const char *activation_name(enum ActivationType type)
+{
+    switch (type) {
+    case NN_LINEAR:         return "linear";
+    case NN_RELU:           return "relu";
+    case NN_LEAKY_RELU:     return "leaky_relu";
+    case NN_SIGMOID:        return "sigmoid";
+    case NN_SOFTPLUS:       return "softplus";
+    case NN_TANH:           return "tanh";
+    }
+    die("activation_name() Error: unknown activation %d", type);
+    return NULL;
+}
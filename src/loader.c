@@ -0,0 +1,364 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "nn.h"
+#include "dataset.h"
+#include "loader.h"
+
+static void loader_init(Loader *loader, struct Configs cfg, size_t in_cols, size_t out_cols);
+static void loader_run(Loader *loader);
+static void *loader_thread(void *arg);
+static bool produce(Loader *loader, Batch *batch);
+static bool produce_memory(Loader *loader, Batch *batch);
+static bool produce_stream(Loader *loader, Batch *batch);
+static void stream_fill(Loader *loader);
+static void shuffle_order(size_t *order, size_t n);
+static void gather_sparse(Batch *batch, Sparse *src, size_t *order, size_t rows);
+static double now(void);
+
+void loader_start(
+        Loader *loader, struct Configs cfg,
+        Tensor *input, Sparse *sparse_input, Tensor *labels,
+        size_t *rows, size_t n_rows)
+{
+    *loader = (Loader){.input = input, .labels = labels, .sparse = sparse_input, .rows = rows, .samples = n_rows};
+
+    // dense rows keep one permutation shuffled further every epoch, sparse ones restart it
+    loader->order = ecalloc(loader->samples, sizeof(size_t));
+    for (size_t i = 0; i < loader->samples; i++) loader->order[i] = (rows) ? rows[i] : i;
+
+    loader_init(loader, cfg, input->shape[1], labels->shape[1]);
+    loader_run(loader);
+}
+
+void loader_start_stream(Loader *loader, struct Configs cfg, Dataset *ds)
+{
+    if (cfg.stream_block == 0) die("loader_start_stream() Error: stream_block must be greater than 0");
+    *loader = (Loader){.ds = ds, .samples = ds->rows, .block = cfg.stream_block};
+
+    // buffers hold whole blocks plus the rows carried from the previous one
+    size_t fill = (cfg.stream_buffer > cfg.batch_size) ? cfg.stream_buffer : cfg.batch_size;
+    loader->fill = (fill + loader->block - 1) / loader->block * loader->block;
+    loader->buffer_input = tensor_alloc(loader->fill + cfg.batch_size, ds->in_cols);
+    loader->buffer_labels = tensor_alloc(loader->fill + cfg.batch_size, ds->out_cols);
+    loader->n_blocks = (ds->rows + loader->block - 1) / loader->block;
+    loader->blocks = ecalloc(loader->n_blocks, sizeof(size_t));
+
+    loader_init(loader, cfg, ds->in_cols, ds->out_cols);
+    loader_run(loader);
+}
+
+/* Next batch in training order, NULL after the last epoch. Slot is owned until loader_release() */
+Batch *loader_next(Loader *loader)
+{
+    Batch *batch = NULL;
+
+    if (!loader->threaded) return produce(loader, &loader->slots[0]) ? &loader->slots[0] : NULL;
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->count == 0 && !loader->done) {
+        double t0 = now();
+        while (loader->count == 0 && !loader->done) pthread_cond_wait(&loader->ready, &loader->lock);
+        loader->stall += now() - t0;
+        loader->stalls++;
+    }
+    if (loader->count) {
+        batch = &loader->slots[loader->head];
+        loader->batches++;
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return batch;
+}
+
+void loader_release(Loader *loader, Batch *batch)
+{
+    if (!loader->threaded) return;
+
+    pthread_mutex_lock(&loader->lock);
+    if (batch != &loader->slots[loader->head]) die("loader_release() Error: batches must be released in order");
+    loader->head = (loader->head + 1) % loader->n_slots;
+    loader->count--;
+    pthread_cond_signal(&loader->freed);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+/* Wait for the loader thread, report the trainer stall time and free the loader */
+void loader_stop(Loader *loader)
+{
+    if (loader->threaded) {
+        pthread_join(loader->thread, NULL);
+        pthread_mutex_destroy(&loader->lock);
+        pthread_cond_destroy(&loader->ready);
+        pthread_cond_destroy(&loader->freed);
+
+        double elapsed = now() - loader->start;
+        if (!loader->quiet) fprintf(stderr, "loader: training waited %.3fs for data on %zu of %zu batches (%.1f%% of %.3fs)\n",
+                loader->stall, loader->stalls, loader->batches,
+                (elapsed > 0) ? 100 * loader->stall / elapsed : 0.0, elapsed);
+    }
+
+    for (size_t i = 0; i < loader->n_slots; i++) {
+        tensor_free(&loader->slots[i].input);
+        tensor_free(&loader->slots[i].labels);
+        free(loader->slots[i].sparse.indptr);
+        free(loader->slots[i].sparse.indices);
+        free(loader->slots[i].sparse.values);
+    }
+    free(loader->slots);
+    free(loader->order);
+    free(loader->blocks);
+    tensor_free(&loader->buffer_input);
+    tensor_free(&loader->buffer_labels);
+}
+
+void loader_init(Loader *loader, struct Configs cfg, size_t in_cols, size_t out_cols)
+{
+    if (cfg.batch_size == 0) die("loader_init() Error: batch size must be greater than 0");
+
+    loader->epochs = cfg.epochs;
+    loader->batch_size = cfg.batch_size;
+    loader->shuffle = cfg.shuffle;
+    loader->quiet = cfg.quiet;
+    loader->new_epoch = true;
+    loader->n_batches = loader->samples / cfg.batch_size;
+    if (loader->samples % cfg.batch_size) {
+        loader->n_batches++;
+    }
+
+    loader->threaded = cfg.prefetch > 0;
+    loader->n_slots = cfg.prefetch + 1;
+    loader->slots = ecalloc(loader->n_slots, sizeof(Batch));
+    for (size_t i = 0; i < loader->n_slots; i++) {
+        Batch *batch = &loader->slots[i];
+        batch->labels = tensor_alloc(cfg.batch_size, out_cols);
+        if (loader->sparse) {
+            batch->input = (Tensor){.shape = {cfg.batch_size, in_cols}};
+            batch->sparse.indptr = ecalloc(cfg.batch_size + 1, sizeof(size_t));
+        } else {
+            batch->input = tensor_alloc(cfg.batch_size, in_cols);
+        }
+    }
+}
+
+void loader_run(Loader *loader)
+{
+    loader->start = now();
+    if (!loader->threaded) return;
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->ready, NULL);
+    pthread_cond_init(&loader->freed, NULL);
+    if (pthread_create(&loader->thread, NULL, loader_thread, loader)) die("loader_run() Error:");
+}
+
+void *loader_thread(void *arg)
+{
+    Loader *loader = arg;
+    bool more = true;
+
+    while (more) {
+        pthread_mutex_lock(&loader->lock);
+        while (loader->count == loader->n_slots) pthread_cond_wait(&loader->freed, &loader->lock);
+        Batch *batch = &loader->slots[(loader->head + loader->count) % loader->n_slots];
+        pthread_mutex_unlock(&loader->lock);
+
+        // the slot is past the ones the trainer sees, it can be filled unlocked
+        more = produce(loader, batch);
+
+        pthread_mutex_lock(&loader->lock);
+        if (more) loader->count++;
+        else loader->done = true;
+        pthread_cond_signal(&loader->ready);
+        pthread_mutex_unlock(&loader->lock);
+    }
+    return NULL;
+}
+
+bool produce(Loader *loader, Batch *batch)
+{
+    return (loader->ds) ? produce_stream(loader, batch) : produce_memory(loader, batch);
+}
+
+bool produce_memory(Loader *loader, Batch *batch)
+{
+    if (loader->samples == 0 || loader->epoch == loader->epochs) return false;
+    if (loader->new_epoch) {
+        if (loader->sparse) {
+            for (size_t i = 0; i < loader->samples; i++) loader->order[i] = (loader->rows) ? loader->rows[i] : i;
+        }
+        if (loader->shuffle) shuffle_order(loader->order, loader->samples);
+        loader->index = loader->batch_index = 0;
+        loader->new_epoch = false;
+    }
+
+    size_t remaining = loader->samples - loader->index;
+    size_t rows = (remaining < loader->batch_size) ? remaining : loader->batch_size;
+    size_t *order = loader->order + loader->index;
+
+    for (size_t i = 0; i < rows; i++) {
+        memcpy(TENSOR_ROW(batch->labels, i), TENSOR_ROW(*loader->labels, order[i]),
+               loader->labels->shape[1] * sizeof(nn_float));
+    }
+    if (loader->sparse) {
+        gather_sparse(batch, loader->sparse, order, rows);
+    } else {
+        for (size_t i = 0; i < rows; i++) {
+            memcpy(TENSOR_ROW(batch->input, i), TENSOR_ROW(*loader->input, order[i]),
+                   loader->input->shape[1] * sizeof(nn_float));
+        }
+    }
+
+    batch->rows = rows;
+    batch->epoch = loader->epoch;
+    batch->index = loader->batch_index++;
+    loader->index += rows;
+    if (loader->index == loader->samples) {
+        loader->epoch++;
+        loader->new_epoch = true;
+    }
+    return true;
+}
+
+/*
+ * Batches are taken from the buffer, when it has no full batch left its rows
+ * move to the front and the next blocks are appended. The remaining rows make
+ * the last batch of the epoch.
+ */
+bool produce_stream(Loader *loader, Batch *batch)
+{
+    size_t rows;
+
+    while (1) {
+        if (loader->new_epoch) {
+            if (loader->epoch == loader->epochs) return false;
+            for (size_t i = 0; i < loader->n_blocks; i++) loader->blocks[i] = i;
+            if (loader->shuffle) shuffle_order(loader->blocks, loader->n_blocks);
+            loader->next_block = loader->filled = loader->index = loader->batch_index = 0;
+            loader->new_epoch = false;
+        }
+
+        rows = loader->filled - loader->index;
+        if (rows >= loader->batch_size) {
+            rows = loader->batch_size;
+            break;
+        } else if (loader->next_block < loader->n_blocks) {
+            stream_fill(loader);
+        } else if (rows > 0) {
+            break;
+        } else {
+            loader->epoch++;
+            loader->new_epoch = true;
+        }
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        memcpy(TENSOR_ROW(batch->input, i), TENSOR_ROW(loader->buffer_input, loader->index + i),
+               loader->ds->in_cols * sizeof(nn_float));
+        memcpy(TENSOR_ROW(batch->labels, i), TENSOR_ROW(loader->buffer_labels, loader->index + i),
+               loader->ds->out_cols * sizeof(nn_float));
+    }
+
+    batch->rows = rows;
+    batch->epoch = loader->epoch;
+    batch->index = loader->batch_index++;
+    loader->index += rows;
+    return true;
+}
+
+/* Move the rows left on the buffer to its front and append the next blocks to them */
+void stream_fill(Loader *loader)
+{
+    Dataset *ds = loader->ds;
+    size_t kept = loader->filled - loader->index;
+
+    for (size_t i = 0; i < kept && loader->index > 0; i++) {
+        memcpy(TENSOR_ROW(loader->buffer_input, i), TENSOR_ROW(loader->buffer_input, loader->index + i),
+               ds->in_cols * sizeof(nn_float));
+        memcpy(TENSOR_ROW(loader->buffer_labels, i), TENSOR_ROW(loader->buffer_labels, loader->index + i),
+               ds->out_cols * sizeof(nn_float));
+    }
+    loader->filled = kept;
+    loader->index = 0;
+
+    for (; loader->next_block < loader->n_blocks && loader->filled < kept + loader->fill; loader->next_block++) {
+        size_t start = loader->blocks[loader->next_block] * loader->block;
+        size_t rows = (ds->rows - start < loader->block) ? ds->rows - start : loader->block;
+        Tensor input_rows = tensor_rows(loader->buffer_input, loader->filled, rows);
+        Tensor labels_rows = tensor_rows(loader->buffer_labels, loader->filled, rows);
+
+        dataset_read(ds, start, rows, &input_rows, &labels_rows);
+        loader->filled += rows;
+    }
+
+    if (loader->shuffle) {
+        Tensor input_filled = tensor_rows(loader->buffer_input, 0, loader->filled);
+        Tensor labels_filled = tensor_rows(loader->buffer_labels, 0, loader->filled);
+        dataset_shuffle_rows(&input_filled, &labels_filled);
+    }
+}
+
+/* same swaps dataset_shuffle_rows() does on the rows */
+void shuffle_order(size_t *order, size_t n)
+{
+    size_t tmp, random_row;
+    for (size_t row = 0; row < n; row++) {
+        random_row = random() % n;
+        tmp = order[row];
+        order[row] = order[random_row];
+        order[random_row] = tmp;
+    }
+}
+
+void gather_sparse(Batch *batch, Sparse *src, size_t *order, size_t rows)
+{
+    Sparse *dest = &batch->sparse;
+    size_t nnz = 0;
+
+    for (size_t row = 0; row < rows; row++) nnz += src->indptr[order[row] + 1] - src->indptr[order[row]];
+    if (nnz > batch->nnz_capacity) {
+        dest->indices = erealloc(dest->indices, nnz * sizeof(size_t));
+        dest->values = erealloc(dest->values, nnz * sizeof(nn_float));
+        batch->nnz_capacity = nnz;
+    }
+
+    dest->indptr[0] = 0;
+    for (size_t row = 0; row < rows; row++) {
+        size_t start = src->indptr[order[row]];
+        nnz = src->indptr[order[row] + 1] - start;
+
+        memcpy(dest->indices + dest->indptr[row], src->indices + start, nnz * sizeof(size_t));
+        memcpy(dest->values + dest->indptr[row], src->values + start, nnz * sizeof(nn_float));
+        dest->indptr[row + 1] = dest->indptr[row] + nnz;
+    }
+    dest->shape[0] = rows;
+    dest->shape[1] = src->shape[1];
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
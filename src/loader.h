@@ -0,0 +1,87 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LOADER__
+#define __LOADER__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "tensor.h"
+#include "nn.h"
+#include "dataset.h"
+
+/*
+ * Training batches producer. A loader thread gathers the shuffled rows of the
+ * next batches (or reads them from a dataset file) into a ring of prefetch + 1
+ * slots while the training thread works on the current one; prefetch = 0
+ * prepares each batch on the training thread instead.
+ */
+typedef struct Batch {
+    Tensor input;       /* batch_size rows, data is NULL with sparse inputs */
+    Tensor labels;
+    Sparse sparse;
+    size_t nnz_capacity;
+    size_t rows;        /* rows filled, batch_size but on the last batch of an epoch */
+    size_t epoch, index;
+} Batch;
+
+typedef struct Loader {
+    size_t epochs, batch_size, samples, n_batches;
+    bool shuffle;
+
+    /* in memory source */
+    Tensor *input, *labels;
+    Sparse *sparse;
+    size_t *rows;       /* rows trained on, every row when NULL */
+    size_t *order;
+
+    /* dataset file source, read by blocks into buffer */
+    Dataset *ds;
+    Tensor buffer_input, buffer_labels;
+    size_t *blocks, n_blocks, block, next_block, fill, filled;
+
+    /* producer position */
+    size_t epoch, index, batch_index;
+    bool new_epoch;
+
+    /* ring, slots [head, head + count) are ready or in use by the trainer */
+    Batch *slots;
+    size_t n_slots, head, count;
+    bool done, threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, freed;
+
+    /* seconds the trainer waited for data */
+    double start, stall;
+    size_t stalls, batches;
+    bool quiet;
+} Loader;
+
+void loader_start(
+        Loader *loader, struct Configs cfg,
+        Tensor *input, Sparse *sparse_input, Tensor *labels,
+        size_t *rows, size_t n_rows);
+void loader_start_stream(Loader *loader, struct Configs cfg, Dataset *ds);
+Batch *loader_next(Loader *loader);
+void loader_release(Loader *loader, Batch *batch);
+void loader_stop(Loader *loader);
+#endif
@@ -23,11 +23,18 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <getopt.h>
+#include <sys/stat.h>
 #include <json-c/json.h>
 
 #include "util.h"
 #include "parse.h"
 #include "nn.h"
+#include "blas.h"
+#include "dataset.h"
+#include "pipeline.h"
+#include "sweep.h"
+#include "ensemble.h"
+#include "pool.h"
 
 #define MAX_FILE_SIZE 536870912 //1<<29; 0.5 GiB
 
@@ -51,31 +58,258 @@ void load_config(struct Configs *cfg, int n_args, ...)
     die("load_config('%s') Error:", filepath);
 }
 
-Layer * load_network(struct Configs cfg)
+/*
+ * Mostly onehot inputs are kept sparse, the first layer then works as an embedding.
+ * X keeps the input shape even when its values are on X_sparse.
+ */
+Sparse * load_input(Tensor *X, Sparse *X_sparse, Array *in, struct Configs cfg)
+{
+    // libsvm files are read straight into X_sparse
+    if (X_sparse->indptr) {
+        *X = (Tensor){.shape = {X_sparse->shape[0], X_sparse->shape[1]}};
+        return X_sparse;
+    }
+
+    if (!array_is_sparse(*in)) {
+        *X = data_preprocess(in, cfg, true, false);
+        return NULL;
+    }
+
+    data_preprocess_sparse(X_sparse, in, cfg);
+    *X = (Tensor){.shape = {X_sparse->shape[0], X_sparse->shape[1]}};
+    return X_sparse;
+}
+
+char * input_format(char *filepath, struct Configs cfg)
+{
+    return (strcmp(filepath, "-")) ? file_format_infer(filepath) : cfg.file_format;
+}
+
+bool is_chunked_format(char *file_format)
+{
+    return file_format && (!strcmp(file_format, "csv") || !strcmp(file_format, "tsv"));
+}
+
+/* Write FILE as a dataset file, csv and tsv files are converted by chunks of stream_buffer rows */
+void preprocess_file(char *filepath, Array *in, Array *out, struct Configs cfg)
+{
+    char *file_format = input_format(filepath, cfg);
+    Dataset ds = {0};
+    Tensor X, y;
+
+    if (!cfg.out_filepath) die("preprocess_file() Error: preprocess needs the dataset output file (-o FILE)");
+    if (is_chunked_format(file_format)) {
+        CsvStream stream;
+        size_t rows;
+
+        if (cfg.stream_buffer == 0) die("preprocess_file() Error: stream_buffer must be greater than 0");
+        csv_stream_open(&stream, filepath, in, out, cfg, true);
+        do {
+            rows = csv_stream_read(&stream, in, out, cfg, cfg.stream_buffer);
+            X = data_preprocess(in, cfg, true, false);
+            y = data_preprocess(out, cfg, false, false);
+            if (!ds.fp) dataset_create(&ds, cfg.out_filepath, X.shape[1], y.shape[1], dataset_layout(cfg));
+            dataset_append(&ds, &X, &y);
+            tensor_free(&X);
+            tensor_free(&y);
+        } while (rows == cfg.stream_buffer);
+        csv_stream_close(&stream);
+    } else {
+        Sparse X_sparse = {0};
+
+        file_read(filepath, in, &X_sparse, out, cfg, true);
+        if (X_sparse.indptr) die("preprocess_file() Error: libsvm files can not be preprocessed");
+        X = data_preprocess(in, cfg, true, false);
+        y = data_preprocess(out, cfg, false, false);
+        dataset_create(&ds, cfg.out_filepath, X.shape[1], y.shape[1], dataset_layout(cfg));
+        dataset_append(&ds, &X, &y);
+        tensor_free(&X);
+        tensor_free(&y);
+    }
+    fprintf(stderr, "%zu rows saved on '%s'\n", ds.rows, cfg.out_filepath);
+    dataset_close(&ds);
+}
+
+bool is_dataset_file(char *filepath, struct Configs cfg)
+{
+    char *file_format = input_format(filepath, cfg);
+    return file_format && !strcmp(file_format, "mlds");
+}
+
+/* LIBSVM files leave out their trailing zero features, their width is the weights one */
+void weights_features(struct Configs *cfg, char *weights_filepath)
+{
+    if (!cfg->n_features && weights_filepath) cfg->n_features = nn_network_read_input_nodes(weights_filepath);
+}
+
+/* Files of one ml predict, the networks are loaded once for all of them */
+struct Batch {
+    char **inputs, **outputs;
+    size_t n_files;
+    struct Configs cfg;
+    Ensemble *ensemble;
+};
+
+/* Predict a file with the loaded networks, a NULL out_filepath writes to stdout */
+void predict_file(char *filepath, char *out_filepath, Ensemble *ensemble, struct Configs cfg)
 {
-    extern struct Activation NN_RELU;
-    extern struct Activation NN_SOFTPLUS;
-    extern struct Activation NN_SIGMOID;
-    extern struct Activation NN_LEAKY_RELU;
-    extern struct Activation NN_LINEAR;
-    extern struct Activation NN_TANH;
-
-    Layer *network = ecalloc(cfg.network_size, sizeof(Layer));
-
-    for (size_t i = 0; i < cfg.network_size; i++) {
-        if (!strcmp("relu", cfg.activations[i]))                network[i].activation = NN_RELU;
-        else if (!strcmp("sigmoid", cfg.activations[i]))        network[i].activation = NN_SIGMOID;
-        else if (!strcmp("softplus", cfg.activations[i]))       network[i].activation = NN_SOFTPLUS;
-        else if (!strcmp("leaky_relu", cfg.activations[i]))     network[i].activation = NN_LEAKY_RELU;
-        else if (!strcmp("linear", cfg.activations[i]))         network[i].activation = NN_LINEAR;
-        else if (!strcmp("tanh", cfg.activations[i]))           network[i].activation = NN_TANH;
-        else die("load_network() Error: Unknown '%s' activation", cfg.activations[i]);
-
-        network[i].neurons = cfg.neurons[i];
+    struct Configs out_cfg = ensemble->cfg;
+
+    cfg.out_filepath = out_cfg.out_filepath = out_filepath;
+    if (cfg.predict_chunk && is_chunked_format(input_format(filepath, cfg))) {
+        Pipeline pipeline;
+        pipeline_open(&pipeline, filepath, cfg);
+        if (pipeline.in_cols != ensemble->in_cols) goto predict_file_error;
+        if (!cfg.file_format && !cfg.out_filepath) out_cfg.file_format = file_format_infer(filepath);
+        pipeline_predict(&pipeline, ensemble, out_cfg);
+        return;
+    }
+
+    Array in = {0}, out = {0};
+    Sparse X_sparse = {0}, *X_sparse_ptr;
+    Tensor X, y;
+
+    // LIBSVM files leave out their trailing zero features
+    if (!cfg.n_features) cfg.n_features = ensemble->in_cols;
+    file_read(filepath, &in, &X_sparse, &out, cfg, false);
+    X_sparse_ptr = load_input(&X, &X_sparse, &in, cfg);
+    if (X.shape[1] != ensemble->in_cols) goto predict_file_error;
+
+    // If neither output and file_format defined use input to define the output format
+    if (!cfg.file_format && !cfg.out_filepath) {
+        out_cfg.file_format = file_format_infer(filepath);
+        if (X_sparse.indptr) out_cfg.file_format = "csv";
     }
-    return network;
+    if (ensemble->each) {
+        array_free(&out);
+        out = (Array){0};
+        array_set_fields(&out, out_cfg.label_keys, out_cfg.n_label_keys, out_cfg);
+    }
+    y = tensor_alloc(X.shape[0], ensemble->out_cols);
+    ensemble_predict(ensemble, &y, &X, X_sparse_ptr);
+    data_postprocess(&out, &y, out_cfg, false);
+    file_write(in, out, out_cfg);
+
+    array_free(&in);
+    array_free(&out);
+    tensor_free(&X);
+    tensor_free(&y);
+    sparse_free(&X_sparse);
+    return;
+
+predict_file_error:
+    die("predict_file() Error: the inputs of '%s' don't match the %zu network inputs", filepath, ensemble->in_cols);
 }
 
+void predict_job(void *arg, size_t file)
+{
+    struct Batch *batch = arg;
+    predict_file(batch->inputs[file], batch->outputs[file], batch->ensemble, batch->cfg);
+}
+
+/* DIR/<input file name>, libsvm inputs are written as csv */
+char * batch_output(char *filepath, char *out_dir)
+{
+    char *name = strrchr(filepath, '/'), *ext, *out;
+    size_t stem, size;
+
+    if (!out_dir) die("predict_files() Error: '%s' has no output file, batches need -o DIR", filepath);
+    name = (name) ? name + 1 : filepath;
+    ext = strrchr(name, '.');
+    stem = (ext && (!strcmp(ext, ".svm") || !strcmp(ext, ".libsvm"))) ? (size_t)(ext - name) : strlen(name);
+
+    size = strlen(out_dir) + stem + 6;
+    out = ecalloc(size, sizeof(char));
+    snprintf(out, size, "%s/%.*s%s", out_dir, (int)stem, name, (stem < strlen(name)) ? ".csv" : "");
+    return out;
+}
+
+/* out_filepath is owned by the batch after this */
+void batch_add(struct Batch *batch, char *filepath, char *out_filepath)
+{
+    struct stat in_st, out_st;
+
+    // writing over the input would truncate it before it is read
+    if (out_filepath && !stat(filepath, &in_st) && !stat(out_filepath, &out_st)
+        && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+        die("predict_files() Error: '%s' would be written over its input", out_filepath);
+    }
+
+    batch->inputs = erealloc(batch->inputs, (batch->n_files + 1) * sizeof(char *));
+    batch->outputs = erealloc(batch->outputs, (batch->n_files + 1) * sizeof(char *));
+    batch->inputs[batch->n_files] = e_strdup(filepath);
+    batch->outputs[batch->n_files] = out_filepath;
+    batch->n_files++;
+}
+
+/* Lines are "INPUT" or "INPUT<TAB>OUTPUT", "-" reads the list from stdin */
+void batch_read_list(struct Batch *batch, char *filepath, char *out_dir)
+{
+    FILE *fp = (strcmp(filepath, "-")) ? fopen(filepath, "r") : stdin;
+    char *line = NULL, *output;
+    size_t line_size = 0;
+    ssize_t length;
+
+    if (!fp) die("batch_read_list() Error: '%s':", filepath);
+    while ((length = getline(&line, &line_size, fp)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if (length == 0) continue;
+
+        output = strchr(line, '\t');
+        if (output) *output++ = '\0';
+        batch_add(batch, line, (output) ? e_strdup(output) : batch_output(line, out_dir));
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+}
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Predict FILE, or every FILE and -l list entry into -o DIR on jobs threads.
+ * The config and the weights are read once for the whole batch.
+ */
+void predict_files(struct Configs cfg, size_t n_files, char **filepaths)
+{
+    struct Batch batch = {.cfg = cfg};
+    Ensemble ensemble;
+
+    if (n_files == 1 && !cfg.list_filepath) {
+        batch_add(&batch, filepaths[0], (cfg.out_filepath) ? e_strdup(cfg.out_filepath) : NULL);
+    } else {
+        if (cfg.list_filepath) batch_read_list(&batch, cfg.list_filepath, cfg.out_filepath);
+        for (size_t i = 0; i < n_files; i++) {
+            batch_add(&batch, filepaths[i], batch_output(filepaths[i], cfg.out_filepath));
+        }
+
+        // two files written on the same output would clobber each other
+        char **outputs = ecalloc(batch.n_files, sizeof(char *));
+        memcpy(outputs, batch.outputs, batch.n_files * sizeof(char *));
+        qsort(outputs, batch.n_files, sizeof(char *), compare_paths);
+        for (size_t i = 1; i < batch.n_files; i++) {
+            if (!strcmp(outputs[i - 1], outputs[i])) die("predict_files() Error: '%s' is the output of two files", outputs[i]);
+        }
+        free(outputs);
+    }
+
+    ensemble_load(&ensemble, cfg);
+    batch.ensemble = &ensemble;
+    // the files keep the threads busy, their models run one after the other
+    batch.cfg.sweep_threads = cfg.jobs;
+    if (cfg.jobs != 1) ensemble.cfg.sweep_threads = 1;
+    pool_run(batch.cfg, batch.n_files, predict_job, &batch);
+    ensemble_free(&ensemble);
+
+    for (size_t i = 0; i < batch.n_files; i++) {
+        free(batch.inputs[i]);
+        free(batch.outputs[i]);
+    }
+    free(batch.inputs);
+    free(batch.outputs);
+}
 
 int main(int argc, char *argv[]) {
     char default_config_path[512], *env_config_path;
@@ -84,9 +318,19 @@ int main(int argc, char *argv[]) {
         .batch_size = 32,
         .alpha = 1e-5,
         .shuffle = true,
+        .fast_activations = false,
+        .sparsity = 0.5,
+        .sparse_density = 0.1,
+        .stream_buffer = 65536,
+        .stream_block = 1024,
+        .prefetch = 2,
+        .predict_chunk = 65536,
+        .folds = 5,
+        .jobs = 1,
         .config_filepath = "",
         .network_size = 0,
         .only_out = false,
+        .compact = false,
         .decimal_precision = -1,
         .file_format = NULL,
         .out_filepath = NULL,
@@ -110,45 +354,98 @@ int main(int argc, char *argv[]) {
     argc -= optind;
     argv += optind;
 
+    blas_init(ml_configs.blas_backend, ml_configs.blas_threads);
+    nn_activation_fast(ml_configs.fast_activations);
     Layer *network = load_network(ml_configs);
-    Array in, out;
-    double *X = NULL, *y = NULL;
-    size_t X_shape[2], y_shape[2];
-    if (!strcmp("train", argv[0]) || !strcmp("retrain", argv[0])) {
-        file_read(argv[1], &in, &out, ml_configs, true);
-        X = data_preprocess(X_shape, in, ml_configs, true, false);
-        y = data_preprocess(y_shape, out, ml_configs, false, false);
+    Array in = {0}, out = {0};
+    Sparse X_sparse = {0}, *X_sparse_ptr = NULL;
+    Tensor X = {0}, y = {0};
+    if ((!strcmp("train", argv[0]) || !strcmp("retrain", argv[0])) && is_dataset_file(argv[1], ml_configs)) {
+        Dataset ds;
+        dataset_open(&ds, argv[1]);
+        dataset_check(&ds, argv[1], ml_configs);
+        nn_network_init_weights(network, ml_configs.network_size, ds.in_cols, !strcmp("train", argv[0]));
+        if (!strcmp("retrain", argv[0])) {
+            nn_network_read_weights(ml_configs.weights_filepath, network, ml_configs.network_size);
+        }
+        nn_network_train_stream(network, ml_configs, &ds);
+        dataset_close(&ds);
+        nn_network_write_weights(ml_configs.weights_filepath, network, ml_configs.network_size);
+        fprintf(stderr, "weights saved on '%s'\n", ml_configs.weights_filepath);
+    } else if (!strcmp("train", argv[0]) || !strcmp("retrain", argv[0])) {
+        if (!strcmp("retrain", argv[0])) weights_features(&ml_configs, ml_configs.weights_filepath);
+        file_read(argv[1], &in, &X_sparse, &out, ml_configs, true);
+        X_sparse_ptr = load_input(&X, &X_sparse, &in, ml_configs);
+        y = data_preprocess(&out, ml_configs, false, false);
         if (!strcmp("train", argv[0])) {
-            nn_network_init_weights(network, ml_configs.network_size, X_shape[1], true);
+            nn_network_init_weights(network, ml_configs.network_size, X.shape[1], true);
         } else if (!strcmp("retrain", argv[0])) {
-            nn_network_init_weights(network, ml_configs.network_size, X_shape[1], false);
+            nn_network_init_weights(network, ml_configs.network_size, X.shape[1], false);
             nn_network_read_weights(ml_configs.weights_filepath, network, ml_configs.network_size);
         }
-        nn_network_train(network, ml_configs, X, X_shape, y, y_shape);
+        nn_network_train(network, ml_configs, &X, X_sparse_ptr, &y);
         nn_network_write_weights(ml_configs.weights_filepath, network, ml_configs.network_size);
         fprintf(stderr, "weights saved on '%s'\n", ml_configs.weights_filepath);
     } else if (!strcmp("predict", argv[0])) {
-        file_read(argv[1], &in, &out, ml_configs, false);
-        X = data_preprocess(X_shape, in, ml_configs, true, false);
-        y = data_preprocess(y_shape, out, ml_configs, false, true);
-        nn_network_init_weights(network, ml_configs.network_size, X_shape[1], false);
+        predict_files(ml_configs, (size_t)argc - 1, argv + 1);
+    } else if (!strcmp("quantize", argv[0])) {
+        if (!ml_configs.out_filepath) die("main() Error: quantize needs the int8 weights output file (-o FILE)");
+        weights_features(&ml_configs, ml_configs.weights_filepath);
+        file_read(argv[1], &in, &X_sparse, &out, ml_configs, false);
+        X_sparse_ptr = load_input(&X, &X_sparse, &in, ml_configs);
+        nn_network_init_weights(network, ml_configs.network_size, X.shape[1], false);
         nn_network_read_weights(ml_configs.weights_filepath, network, ml_configs.network_size);
-        nn_network_predict(y, y_shape, X, X_shape, network, ml_configs.network_size);
-
-        // If neither output and file_format defined use input to define the output format
-        if (!ml_configs.file_format && !ml_configs.out_filepath) {
-            ml_configs.file_format = file_format_infer(ml_configs.in_filepath);
+        nn_network_quantize(network, ml_configs.network_size, &X, X_sparse_ptr);
+        nn_network_write_weights_int8(ml_configs.out_filepath, network, ml_configs.network_size);
+        fprintf(stderr, "int8 weights saved on '%s'\n", ml_configs.out_filepath);
+    } else if (!strcmp("prune", argv[0])) {
+        if (!ml_configs.out_filepath) die("main() Error: prune needs the pruned weights output file (-o FILE)");
+        weights_features(&ml_configs, ml_configs.weights_filepath);
+        file_read(argv[1], &in, &X_sparse, &out, ml_configs, ml_configs.epochs > 0);
+        X_sparse_ptr = load_input(&X, &X_sparse, &in, ml_configs);
+        nn_network_init_weights(network, ml_configs.network_size, X.shape[1], false);
+        nn_network_read_weights(ml_configs.weights_filepath, network, ml_configs.network_size);
+        nn_network_prune(network, ml_configs.network_size, ml_configs.sparsity);
+        if (ml_configs.epochs > 0) {
+            y = data_preprocess(&out, ml_configs, false, false);
+            nn_network_train(network, ml_configs, &X, X_sparse_ptr, &y);
+        }
+        nn_network_write_weights_sparse(ml_configs.out_filepath, network, ml_configs.network_size);
+        fprintf(stderr, "pruned weights saved on '%s'\n", ml_configs.out_filepath);
+    } else if (!strcmp("export-c", argv[0])) {
+        if (!ml_configs.out_filepath) die("main() Error: export-c needs the C source output file (-o FILE)");
+        nn_network_init_weights(network, ml_configs.network_size, nn_network_read_input_nodes(argv[1]), false);
+        nn_network_read_weights(argv[1], network, ml_configs.network_size);
+        nn_network_export_c(ml_configs.out_filepath, network, ml_configs.network_size, ml_configs);
+        fprintf(stderr, "C source saved on '%s'\n", ml_configs.out_filepath);
+    } else if (!strcmp("sweep", argv[0]) || !strcmp("cv", argv[0]) || !strcmp("tune", argv[0])) {
+        if (is_dataset_file(argv[1], ml_configs)) {
+            Dataset ds;
+            dataset_open(&ds, argv[1]);
+            dataset_check(&ds, argv[1], ml_configs);
+            X = tensor_alloc(ds.rows, ds.in_cols);
+            y = tensor_alloc(ds.rows, ds.out_cols);
+            dataset_read(&ds, 0, ds.rows, &X, &y);
+            dataset_close(&ds);
+        } else {
+            file_read(argv[1], &in, &X_sparse, &out, ml_configs, true);
+            X_sparse_ptr = load_input(&X, &X_sparse, &in, ml_configs);
+            y = data_preprocess(&out, ml_configs, false, false);
         }
-        data_postprocess(&out, y, y_shape, ml_configs, false);
-        file_write(in, out, ml_configs);
+        if (!strcmp("sweep", argv[0])) sweep_run(ml_configs, &X, X_sparse_ptr, &y);
+        else if (!strcmp("cv", argv[0])) cv_run(ml_configs, &X, X_sparse_ptr, &y);
+        else tune_run(ml_configs, &X, X_sparse_ptr, &y);
+    } else if (!strcmp("preprocess", argv[0])) {
+        preprocess_file(argv[1], &in, &out, ml_configs);
     } else usage(1);
 
     nn_network_free_weights(network, ml_configs.network_size);
     free(network);
     array_free(&in);
     array_free(&out);
-    free(X);
-    free(y);
+    tensor_free(&X);
+    tensor_free(&y);
+    sparse_free(&X_sparse);
     util_free_config(&ml_configs);
     return 0;
 }
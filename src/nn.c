@@ -24,221 +24,306 @@
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
-#include <openblas/cblas.h>
 
 #include "util.h"
 #include "nn.h"
-
+#include "blas.h"
+#include "dataset.h"
+#include "loader.h"
+
+struct TrainState {
+    Tensor *outs, *douts;
+    nn_float **weights, **biases, *params;
+    struct Cost cost;
+};
 
 struct Cost load_loss(struct Configs cfg);
-static void dataset_shuffle_rows(
-        double *inputs, size_t in_shape[2],
-        double *labels, size_t lbl_shape[2]);
-
-static void fill_random_weights(double *weights, double *bias, size_t rows, size_t cols);
+static void train_state_init(struct TrainState *state, Layer network[], struct Configs ml_configs);
+static void train_state_free(struct TrainState *state, size_t network_size);
+static void train_loop(struct TrainState *state, Layer network[], struct Configs ml_configs, Loader *loader);
+static void train_batch(
+        struct TrainState *state,
+        Layer network[], struct Configs ml_configs,
+        Tensor *input, Sparse *sparse_input, Tensor *labels,
+        double epoch);
+static void fill_random_weights(nn_float *weights, nn_float *bias, size_t rows, size_t cols);
+static size_t params_block_size(size_t rows, size_t cols);
+static uint32_t read_weights_header(FILE *fp, char *filepath, bool *sparse);
+static bool read_layer_values(FILE *fp, Layer *layer, uint32_t dtype, bool sparse);
 
-static double get_avg_loss(
-        double labels[], double outs[], size_t shape[2],
-        double (*loss)(double *, double *, size_t));
+static nn_float get_avg_loss(
+        Tensor *labels, Tensor *outs,
+        nn_float (*loss)(nn_float *, nn_float *, size_t));
 
 
-double square_loss(double labels[], double net_outs[], size_t shape);
-double square_dloss_out(double labels, double net_out);
+nn_float square_loss(nn_float labels[], nn_float net_outs[], size_t shape);
+nn_float square_dloss_out(nn_float labels, nn_float net_out);
 
 struct Cost NN_SQUARE = {
     .func = square_loss,
     .dfunc_out = square_dloss_out
 };
 
+/* Layers of the [layer] sections, their weights are set by nn_network_init_weights() */
+Layer * load_network(struct Configs cfg)
+{
+    Layer *network = ecalloc(cfg.network_size, sizeof(Layer));
+
+    for (size_t i = 0; i < cfg.network_size; i++) {
+        if (!strcmp("relu", cfg.activations[i]))                network[i].activation = NN_RELU;
+        else if (!strcmp("sigmoid", cfg.activations[i]))        network[i].activation = NN_SIGMOID;
+        else if (!strcmp("softplus", cfg.activations[i]))       network[i].activation = NN_SOFTPLUS;
+        else if (!strcmp("leaky_relu", cfg.activations[i]))     network[i].activation = NN_LEAKY_RELU;
+        else if (!strcmp("linear", cfg.activations[i]))         network[i].activation = NN_LINEAR;
+        else if (!strcmp("tanh", cfg.activations[i]))           network[i].activation = NN_TANH;
+        else die("load_network() Error: Unknown '%s' activation", cfg.activations[i]);
+
+        network[i].neurons = cfg.neurons[i];
+    }
+    return network;
+}
+
 void nn_network_predict(
-        double *output, size_t output_shape[2],
-        double *input, size_t input_shape[2],
+        Tensor *output,
+        Tensor *input,
+        Sparse *sparse_input,
         Layer network[], size_t network_size)
 {
-    double **outs = calloc(network_size, sizeof(double *));
-    double **zouts = calloc(network_size, sizeof(double *));
-    size_t samples = input_shape[0];
+    Tensor *outs = ecalloc(network_size, sizeof(Tensor));
+    size_t samples = input->shape[0];
     for (size_t l = 0; l < network_size; l++) {
-        outs[l] = calloc(samples * network[l].neurons, sizeof(double));
-        zouts[l] = calloc(samples * network[l].neurons, sizeof(double));
+        outs[l] = tensor_alloc(samples, network[l].neurons);
     }
 
-    nn_forward(outs, zouts, input, input_shape, network, network_size);
-    memmove(output, outs[network_size - 1], samples * output_shape[1] * sizeof(double));
+    nn_forward(outs, NULL, input, sparse_input, network, network_size);
+    for (size_t i = 0; i < samples; i++) {
+        memmove(TENSOR_ROW(*output, i), TENSOR_ROW(outs[network_size - 1], i), output->shape[1] * sizeof(nn_float));
+    }
 
     for (size_t l = 0; l < network_size; l++) {
-        free(outs[l]);
-        free(zouts[l]);
+        tensor_free(&outs[l]);
     }
     free(outs);
-    free(zouts);
 }
 
-void nn_network_train(
+/* Average loss of the network over every input row */
+nn_float nn_network_loss(
         Layer network[], struct Configs ml_configs,
-        double *input, size_t input_shape[2],
-        double *labels, size_t labels_shape[2])
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels)
 {
-    assert(input_shape[0] == labels_shape[0] && "label samples don't correspond with input samples\n");
-
-    size_t epochs = ml_configs.epochs;
-    size_t batch_size = ml_configs.batch_size;
-    size_t network_size = ml_configs.network_size;
-    double alpha = ml_configs.alpha;
-    bool shuffle = ml_configs.shuffle;
-    struct Cost cost = load_loss(ml_configs);
+    Tensor out = tensor_alloc(labels->shape[0], labels->shape[1]);
+    nn_network_predict(&out, input, sparse_input, network, ml_configs.network_size);
+    nn_float loss = get_avg_loss(labels, &out, load_loss(ml_configs).func);
+    tensor_free(&out);
+    return loss;
+}
 
-    double **outs = calloc(network_size, sizeof(double *));
-    double **zouts = calloc(network_size, sizeof(double *));
-    double **weights = calloc(network_size, sizeof(double *));
-    double **biases = calloc(network_size, sizeof(double *));
+void nn_network_train(
+        Layer network[], struct Configs ml_configs,
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels)
+{
+    nn_network_train_rows(network, ml_configs, input, sparse_input, labels, NULL, input->shape[0]);
+}
 
-    if (!outs || !zouts || !weights || !biases) goto nn_network_train_error;
+void nn_network_train_rows(
+        Layer network[], struct Configs ml_configs,
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels,
+        size_t *rows, size_t n_rows)
+{
+    assert(input->shape[0] == labels->shape[0] && "label samples don't correspond with input samples\n");
 
-    double *input_random = calloc(input_shape[0] * input_shape[1], sizeof(double));
-    double *labels_random = calloc(labels_shape[0] * labels_shape[1], sizeof(double));
+    struct TrainState state;
+    Loader loader;
 
-    if (!input_random || !labels_random) goto nn_network_train_error;
+    train_state_init(&state, network, ml_configs);
+    loader_start(&loader, ml_configs, input, sparse_input, labels, rows, n_rows);
+    train_loop(&state, network, ml_configs, &loader);
+    loader_stop(&loader);
+    train_state_free(&state, ml_configs.network_size);
+}
 
-    memcpy(input_random, input, sizeof(double) * input_shape[0] * input_shape[1]);
-    memcpy(labels_random, labels, sizeof(double) * labels_shape[0] * labels_shape[1]);
+/*
+ * Train over a dataset file without loading it. Each epoch reads the file by
+ * blocks of stream_block rows, on a random block order when shuffling, into a
+ * buffer of stream_buffer rows whose rows are shuffled before taking batches
+ * from it. Rows left over from a buffer are carried to the next one so every
+ * batch but the last of the epoch is full; without shuffling the batches are
+ * the same nn_network_train() takes.
+ */
+void nn_network_train_stream(Layer network[], struct Configs ml_configs, Dataset *ds)
+{
+    size_t network_size = ml_configs.network_size;
+    struct TrainState state;
+    Loader loader;
 
+    if (ds->in_cols != network[0].input_nodes || ds->out_cols != network[network_size - 1].neurons) {
+        die("nn_network_train_stream() Error: dataset has %zu inputs and %zu labels, network expects %zu and %zu",
+            ds->in_cols, ds->out_cols, network[0].input_nodes, network[network_size - 1].neurons);
+    }
 
-    size_t samples = input_shape[0];
-    for (size_t l = 0; l < network_size; l++) {
-        outs[l] = calloc(batch_size * network[l].neurons, sizeof(double));
-        zouts[l] = calloc(batch_size * network[l].neurons, sizeof(double));
-        weights[l] = malloc(network[l].input_nodes * network[l].neurons * sizeof(double));
-        biases[l] = malloc(network[l].neurons * sizeof(double));
+    train_state_init(&state, network, ml_configs);
+    loader_start_stream(&loader, ml_configs, ds);
+    train_loop(&state, network, ml_configs, &loader);
+    loader_stop(&loader);
+    train_state_free(&state, network_size);
+}
 
-        if (!outs[l] || !zouts || !weights[l] || !biases) goto nn_network_train_error;
+void train_loop(struct TrainState *state, Layer network[], struct Configs ml_configs, Loader *loader)
+{
+    Batch *batch;
 
+    while ((batch = loader_next(loader))) {
+        Tensor input_batch = tensor_rows(batch->input, 0, batch->rows);
+        Tensor labels_batch = tensor_rows(batch->labels, 0, batch->rows);
+        Sparse *sparse_batch = (batch->sparse.indptr) ? &batch->sparse : NULL;
 
-        memcpy(weights[l], network[l].weights, sizeof(double) * network[l].input_nodes * network[l].neurons);
-        memcpy(biases[l], network[l].bias, sizeof(double) * network[l].neurons);
+        train_batch(state, network, ml_configs,
+                    &input_batch, sparse_batch, &labels_batch,
+                    batch->epoch + (float)batch->index / loader->n_batches);
+        loader_release(loader, batch);
     }
+}
 
+/* batch buffers and the copy of the parameters updated by nn_backward() */
+void train_state_init(struct TrainState *state, Layer network[], struct Configs ml_configs)
+{
+    size_t network_size = ml_configs.network_size;
+    size_t batch_size = ml_configs.batch_size;
 
-    size_t batch_input_shape[2] = {batch_size, input_shape[1]};
-    size_t batch_labels_shape[2] = {batch_size, labels_shape[1]};
-    size_t n_batches = input_shape[0] / batch_size;
-    if (samples % batch_size) {
-        n_batches++;
+    if (network[0].qweights) die("nn_network_train() Error: int8 weights can only be used to predict");
+    for (size_t l = 0; l < network_size; l++) {
+        if (!network[l].weights) die("nn_network_train() Error: sparse weights can only be used to predict");
     }
-    for (size_t epoch = 0; epoch < epochs; epoch++) {
-
-        if (shuffle) {
-            dataset_shuffle_rows(input_random, input_shape, labels_random, labels_shape);
-        }
-
 
-        for (size_t batch_idx = 0; batch_idx < n_batches; batch_idx++) {
-            size_t index = batch_size * batch_idx;
+    state->cost = load_loss(ml_configs);
+    state->outs = ecalloc(network_size, sizeof(Tensor));
+    state->douts = ecalloc(network_size, sizeof(Tensor));
+    state->weights = ecalloc(network_size, sizeof(nn_float *));
+    state->biases = ecalloc(network_size, sizeof(nn_float *));
 
-            double *input_batch = input_random + index * input_shape[1];
-            double *labels_batch = labels_random + index * labels_shape[1];
+    // the updated parameters are a copy of the network slab, layers keep their offsets
+    size_t params_size = nn_network_params_size(network, network_size);
+    state->params = ealigned_calloc(PARAMS_ALIGN, params_size, sizeof(nn_float));
+    memcpy(state->params, network[0].params, params_size * sizeof(nn_float));
 
-            if (batch_idx == n_batches - 1 && samples % batch_size) {
-                batch_input_shape[0] = samples % batch_size;
-                batch_labels_shape[0] = samples % batch_size;
-            }
-
-            nn_forward(outs, zouts, input_batch, batch_input_shape, network, network_size);
-            nn_backward(
-                    weights, biases,
-                    zouts, outs,
-                    input_batch, batch_input_shape,
-                    labels_batch, batch_labels_shape,
-                    network, network_size,
-                    cost.dfunc_out, alpha);
-            double *net_out = outs[network_size - 1];
-            fprintf(stdout, "epoch: %g \t loss: %6.6lf\n",
-                    epoch + (float)batch_idx / n_batches,
-                    get_avg_loss(labels, net_out, batch_labels_shape, cost.func));
-        }
+    for (size_t l = 0; l < network_size; l++) {
+        state->outs[l] = tensor_alloc(batch_size, network[l].neurons);
+        state->douts[l] = tensor_alloc(batch_size, network[l].neurons);
+        state->weights[l] = state->params + (network[l].weights - network[0].params);
+        state->biases[l] = state->params + (network[l].bias - network[0].params);
     }
+}
 
+void train_state_free(struct TrainState *state, size_t network_size)
+{
     for (size_t l = 0; l < network_size; l++) {
-        free(outs[l]);
-        free(zouts[l]);
-        free(weights[l]);
-        free(biases[l]);
+        tensor_free(&state->outs[l]);
+        tensor_free(&state->douts[l]);
     }
+    free(state->params);
+    free(state->douts);
+    free(state->outs);
+    free(state->weights);
+    free(state->biases);
+}
 
-    free(zouts);
-    free(outs);
-    free(weights);
-    free(biases);
+void train_batch(
+        struct TrainState *state,
+        Layer network[], struct Configs ml_configs,
+        Tensor *input, Sparse *sparse_input, Tensor *labels,
+        double epoch)
+{
+    size_t network_size = ml_configs.network_size;
 
-    free(input_random);
-    free(labels_random);
+    nn_forward(state->outs, state->douts, input, sparse_input, network, network_size);
+    nn_backward(
+            state->weights, state->biases,
+            state->douts, state->outs,
+            input,
+            sparse_input,
+            labels,
+            network, network_size,
+            state->cost.dfunc_out, ml_configs.alpha);
+    for (size_t l = 0; l < network_size; l++) {
+        if (!network[l].mask) continue;
+        nn_layer_apply_mask(network[l], state->weights[l]);
+        nn_layer_apply_mask(network[l], network[l].weights);
+    }
+    if (ml_configs.quiet) return;
 
-    return;
-nn_network_train_error:
-    perror("nn_network_train() Error");
-    exit(1);
+    Tensor net_out = tensor_rows(state->outs[network_size - 1], 0, labels->shape[0]);
+    fprintf(stdout, "epoch: %g \t loss: %6.6lf\n",
+            epoch, get_avg_loss(labels, &net_out, state->cost.func));
 }
 
 void nn_backward(
-        double **weights, double **bias,
-        double **Zout, double **Outs,
-        double *Input, size_t input_shape[2],
-        double *Labels, size_t labels_shape[2],
+        nn_float **weights, nn_float **bias,
+        Tensor Dout[], Tensor Outs[],
+        Tensor *Input,
+        Sparse *sparse_input,
+        Tensor *Labels,
         Layer network[], size_t network_size,
-        double (dcost_out_func)(double, double),
-        double alpha)
+        nn_float (dcost_out_func)(nn_float, nn_float),
+        nn_float alpha)
 {
     size_t max_neurons = 0;
     for (size_t l = 0; l < network_size; l++) {
         max_neurons = (max_neurons > network[l].neurons) ? max_neurons : network[l].neurons;
     }
-    double *dcost_outs = calloc(labels_shape[0] * labels_shape[1], sizeof(double));
-    double *delta = calloc(max_neurons, sizeof(double));
-    double *delta_next = calloc(max_neurons, sizeof(double));
+    Tensor dcost_outs = tensor_alloc(Labels->shape[0], Labels->shape[1]);
+    nn_float *delta = calloc(max_neurons, sizeof(nn_float));
+    nn_float *delta_next = calloc(max_neurons, sizeof(nn_float));
 
-    if (!dcost_outs || !delta || !delta_next) goto nn_backward_error;
+    if (!delta || !delta_next) goto nn_backward_error;
 
-    for (size_t i = 0; i < labels_shape[0]; i++) {
-        for (size_t j = 0; j < labels_shape[1]; j++) {
-            size_t index = i * labels_shape[1] + j;
-            dcost_outs[index] = dcost_out_func(Labels[index], Outs[network_size - 1][index]);
+    for (size_t i = 0; i < Labels->shape[0]; i++) {
+        nn_float *labels = TENSOR_ROW(*Labels, i), *net_out = TENSOR_ROW(Outs[network_size - 1], i);
+        for (size_t j = 0; j < Labels->shape[1]; j++) {
+            TENSOR_ROW(dcost_outs, i)[j] = dcost_out_func(labels[j], net_out[j]);
         }
     }
 
-    for (size_t sample = 0; sample < input_shape[0]; sample++) {
+    for (size_t sample = 0; sample < Input->shape[0]; sample++) {
         for (size_t l = network_size - 1; l < network_size; l--) {
             size_t weights_shape[2] = {network[l].input_nodes, network[l].neurons};
             if (l == network_size - 1) {
-                double *zout = Zout[l] + sample * network[l].neurons;
-                double *out_prev = Outs[l - 1] + sample * network[l-1].neurons;
-                double *dcost_out = dcost_outs + sample * network[l].neurons;
-                nn_layer_out_delta(delta, dcost_out, zout, network[l].neurons, network[l].activation.dfunc);
+                nn_float *dout = TENSOR_ROW(Dout[l], sample);
+                nn_float *out_prev = TENSOR_ROW(Outs[l - 1], sample);
+                nn_float *dcost_out = TENSOR_ROW(dcost_outs, sample);
+                nn_layer_out_delta(delta, dcost_out, dout, network[l].neurons);
                 nn_layer_backward(weights[l], bias[l], weights_shape, delta, out_prev, alpha);
             } else if (l == 0) {
                 size_t weights_next_shape[2] = {network[l+1].input_nodes, network[l+1].neurons};
-                double *zout = Zout[l] + sample * network[l].neurons;
-                double *input = Input + sample * input_shape[1];
-                nn_layer_hidden_delta(delta, delta_next, zout, weights[l+1], weights_next_shape, network[l].activation.dfunc);
-                nn_layer_backward(weights[l], bias[l], weights_shape, delta, input, alpha);
+                nn_float *dout = TENSOR_ROW(Dout[l], sample);
+                nn_layer_hidden_delta(delta, delta_next, dout, weights[l+1], weights_next_shape);
+                if (sparse_input) {
+                    nn_layer_backward_sparse(weights[l], bias[l], weights_shape, delta, sparse_input, sample, alpha);
+                } else {
+                    nn_float *input = TENSOR_ROW(*Input, sample);
+                    nn_layer_backward(weights[l], bias[l], weights_shape, delta, input, alpha);
+                }
             } else {
                 size_t weights_next_shape[2] = {network[l+1].input_nodes, network[l+1].neurons};
-                double *zout = Zout[l] + sample * network[l].neurons;
-                double *out_prev = Outs[l - 1] + sample * network[l-1].neurons;
-                nn_layer_hidden_delta(delta, delta_next, zout, weights[l+1], weights_next_shape, network[l].activation.dfunc);
+                nn_float *dout = TENSOR_ROW(Dout[l], sample);
+                nn_float *out_prev = TENSOR_ROW(Outs[l - 1], sample);
+                nn_layer_hidden_delta(delta, delta_next, dout, weights[l+1], weights_next_shape);
                 nn_layer_backward(weights[l], bias[l], weights_shape, delta, out_prev, alpha);
             }
-            memmove(delta_next, delta, weights_shape[1] * sizeof(double));
+            memmove(delta_next, delta, weights_shape[1] * sizeof(nn_float));
         }
 
     }
 
-    for (size_t l = 0; l < network_size; l++) {
-        size_t weights_shape[2] = {network[l].input_nodes, network[l].neurons};
-        memcpy(network[l].weights, weights[l], weights_shape[0] * weights_shape[1] * sizeof(double));
-        memcpy(network[l].bias, bias[l], weights_shape[1] * sizeof(double));
-    }
+    // weights[0] is the start of the updated parameters slab
+    memcpy(network[0].params, weights[0], nn_network_params_size(network, network_size) * sizeof(nn_float));
 
-    free(dcost_outs);
+    tensor_free(&dcost_outs);
     free(delta);
     free(delta_next);
     return;
@@ -248,114 +333,156 @@ nn_backward_error:
 }
 
 void nn_layer_backward(
-        double *weights, double *bias, size_t weights_shape[2],
-        double *delta, double *out_prev,
-        double alpha)
+        nn_float *weights, nn_float *bias, size_t weights_shape[2],
+        nn_float *delta, nn_float *out_prev,
+        nn_float alpha)
 {
     // W_next = W - alpha * out_prev @ delta.T
-    cblas_dger(CblasRowMajor, weights_shape[0], weights_shape[1], -alpha,
-               out_prev, 1, delta, 1, weights, weights_shape[1]);
+    blas_ger(weights_shape[0], weights_shape[1], -alpha,
+             out_prev, delta, weights, weights_shape[1]);
 
     for (size_t j = 0; j < weights_shape[1]; j++)
         bias[j] = bias[j] - alpha * delta[j];
 }
 
-void nn_layer_hidden_delta(
-        double *delta, double *delta_next, double *zout,
-        double *weights_next, size_t weights_shape[2],
-        double (*activation_derivative)(double))
-{
-    for (size_t j = 0; j < weights_shape[0]; j++) {
-        double sum = 0;
-        for (size_t k = 0; k < weights_shape[1]; k++) {
-            size_t index = j * weights_shape[1] + k;
-            sum += delta_next[k] * weights_next[index];
-        }
-        delta[j] = sum * activation_derivative(zout[j]);
+/* Only the weight rows of the stored input values take part on the update */
+void nn_layer_backward_sparse(
+        nn_float *weights, nn_float *bias, size_t weights_shape[2],
+        nn_float *delta, Sparse *input, size_t row,
+        nn_float alpha)
+{
+    for (size_t p = input->indptr[row]; p < input->indptr[row + 1]; p++) {
+        nn_float *weights_row = weights + input->indices[p] * weights_shape[1];
+        nn_float scale = -alpha * input->values[p];
+        for (size_t j = 0; j < weights_shape[1]; j++)
+            weights_row[j] += scale * delta[j];
     }
+
+    for (size_t j = 0; j < weights_shape[1]; j++)
+        bias[j] = bias[j] - alpha * delta[j];
 }
 
-void nn_layer_out_delta(
-        double *delta, double *error, double *zout,
-        size_t cols,
-        double (*activation_derivative)(double))
+void nn_layer_hidden_delta(
+        nn_float *delta, nn_float *delta_next, nn_float *dout,
+        nn_float *weights_next, size_t weights_shape[2])
 {
+    // delta = (W_next @ delta_next) * dout
+    blas_gemv(weights_shape[0], weights_shape[1], 1.0,
+              weights_next, weights_shape[1], delta_next, 0.0, delta);
+    for (size_t j = 0; j < weights_shape[0]; j++)
+        delta[j] *= dout[j];
+}
 
+void nn_layer_out_delta(
+        nn_float *delta, nn_float *error, nn_float *dout,
+        size_t cols)
+{
     for (size_t i = 0; i < cols; i++) {
-        delta[i] = error[i] * activation_derivative(zout[i]);
+        delta[i] = error[i] * dout[i];
     }
 }
 
+/* dout can be NULL when derivatives are not needed (predictions) */
 void nn_forward(
-        double **out, double **zout,
-        double *X, size_t X_shape[2],
+        Tensor out[], Tensor dout[],
+        Tensor *X,
+        Sparse *sparse_X,
         Layer network[], size_t network_size)
 {
-    size_t in_shape[2] = {X_shape[0], X_shape[1]};
-    size_t out_shape[2];
-    out_shape[0] = X_shape[0];
-    double *input = X;
+    size_t rows = X->shape[0];
+    Tensor input = *X;
 
     for (size_t l = 0; l < network_size; l++) {
-        out_shape[1] = network[l].neurons;
-        nn_layer_forward(network[l], zout[l], out_shape, input, in_shape);
-        nn_layer_map_activation(network[l].activation.func, out[l], out_shape, zout[l], out_shape);
-        in_shape[1] = out_shape[1];
-        input = out[l];
+        Tensor out_l = tensor_rows(out[l], 0, rows), dout_l;
+        Tensor *dout_ptr = NULL;
+        if (dout) {
+            dout_l = tensor_rows(dout[l], 0, rows);
+            dout_ptr = &dout_l;
+        }
+
+        if (network[l].qweights && l == 0 && sparse_X) nn_layer_forward_sparse_int8(network[l], &out_l, sparse_X);
+        else if (network[l].qweights) nn_layer_forward_int8(network[l], &out_l, &input);
+        else if (network[l].sparse_weights.indptr && l == 0 && sparse_X) nn_layer_forward_sparse_csr(network[l], &out_l, sparse_X);
+        else if (network[l].sparse_weights.indptr) nn_layer_forward_csr(network[l], &out_l, &input);
+        else if (l == 0 && sparse_X) nn_layer_forward_sparse(network[l], &out_l, dout_ptr, sparse_X);
+        else nn_layer_forward(network[l], &out_l, dout_ptr, &input);
+        input = out_l;
     }
 }
 
-void nn_layer_map_activation(
-        double (*activation)(double),
-        double *aout, size_t aout_shape[2],
-        double *zout, size_t zout_shape[2])
+/* bias, activation and its derivative are applied row by row while the gemm output is in cache */
+void nn_layer_forward(
+        Layer layer,
+        Tensor *out, Tensor *dout,
+        Tensor *input)
 {
-    if (zout_shape[0] != aout_shape[0] || zout_shape[1] != aout_shape[1]) {
+    if (out->shape[0] != input->shape[0] || out->shape[1] != layer.neurons) {
         fprintf(stderr,
-                "nn_layer_map_activation() Error: zout must have (%zu x %zu) dimensions not (%zu x %zu)\n",
-                aout_shape[0], aout_shape[1], zout_shape[0], zout_shape[1]);
+                "nn_layer_forward() Error: out must have (%zu x %zu) dimensions not (%zu x %zu)\n",
+                input->shape[0], layer.neurons, out->shape[0], out->shape[1]);
         exit(1);
     }
 
-    for (size_t i = 0; i < aout_shape[0]; i++) {
-        for (size_t j = 0; j < aout_shape[1]; j ++) {
-            size_t index = aout_shape[1] * i + j;
-            aout[index] = activation(zout[index]);
-        }
+    blas_gemm(input->shape[0], layer.neurons, layer.input_nodes, // m, n, k
+              1.0, input->data, input->ld, //alpha X
+              layer.weights, layer.neurons, // W
+              0.0, out->data, out->ld); // beta Z
+
+    for (size_t i = 0; i < input->shape[0]; i++) {
+        nn_activation_epilogue(layer.activation, TENSOR_ROW(*out, i), (dout) ? TENSOR_ROW(*dout, i) : NULL,
+                               layer.bias, layer.neurons);
     }
 }
 
-void nn_layer_forward(Layer layer, double *zout, size_t zout_shape[2], double *input, size_t input_shape[2])
+/* Each stored input value adds its scaled weight row, one-hot inputs become row lookups */
+void nn_layer_forward_sparse(
+        Layer layer,
+        Tensor *out, Tensor *dout,
+        Sparse *input)
 {
-    if (zout_shape[0] != input_shape[0] || zout_shape[1] != layer.neurons) {
+    if (out->shape[0] != input->shape[0] || out->shape[1] != layer.neurons) {
         fprintf(stderr,
-                "nn_layer_forward() Error: zout must have (%zu x %zu) dimensions not (%zu x %zu)\n",
-                input_shape[0], layer.neurons, zout_shape[0], zout_shape[1]);
+                "nn_layer_forward_sparse() Error: out must have (%zu x %zu) dimensions not (%zu x %zu)\n",
+                input->shape[0], layer.neurons, out->shape[0], out->shape[1]);
         exit(1);
     }
 
-    for (size_t i = 0; i < input_shape[0]; i++) {
-        for (size_t j = 0; j < layer.neurons; j++) {
-            size_t index = layer.neurons * i + j;
-            zout[index] = layer.bias[j];
+    for (size_t i = 0; i < input->shape[0]; i++) {
+        nn_float *z = TENSOR_ROW(*out, i);
+        memset(z, 0, layer.neurons * sizeof(nn_float));
+
+        for (size_t p = input->indptr[i]; p < input->indptr[i + 1]; p++) {
+            nn_float *weights_row = layer.weights + input->indices[p] * layer.neurons;
+            nn_float value = input->values[p];
+            for (size_t j = 0; j < layer.neurons; j++)
+                z[j] += value * weights_row[j];
         }
+        nn_activation_epilogue(layer.activation, z, (dout) ? TENSOR_ROW(*dout, i) : NULL,
+                               layer.bias, layer.neurons);
     }
-
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                input_shape[0], layer.neurons, layer.input_nodes, // m, n, k
-                1.0, input, input_shape[1], //alpha X
-                layer.weights, layer.neurons, // W
-                1.0, zout, layer.neurons); // beta B
 }
 
+/*
+ * Weights files start with WEIGHTS_MAGIC and the size of their values (4 or 8,
+ * WEIGHTS_INT8 for quantized ones, WEIGHTS_SPARSE set for pruned ones), files
+ * without it are the old float64 layout.
+ * Values are converted on load so float32 and float64 builds can share them.
+ */
 void nn_network_read_weights(char *filepath, Layer *network, size_t network_size)
 {
     FILE *fp = fopen(filepath, "rb");
     if (fp == NULL) die("nn_network_read_weights Error():");
 
+    bool sparse;
+    uint32_t dtype = read_weights_header(fp, filepath, &sparse);
     size_t net_size, shape[2], ret;
+
     ret = fread(&net_size, sizeof(size_t), 1, fp);
-    if (net_size != network_size) goto nn_network_read_weights_error;
+    if (ret != 1 || net_size != network_size) goto nn_network_read_weights_error;
+    if (dtype == WEIGHTS_INT8 && network[0].weights) {
+        free(network[0].params);
+        nn_network_init_bias(network, network_size, network[0].input_nodes);
+    }
 
     for (size_t i = 0; i < network_size; i++) {
         fread(shape, sizeof(size_t), 2, fp);
@@ -364,16 +491,11 @@ void nn_network_read_weights(char *filepath, Layer *network, size_t network_size
             goto nn_network_read_weights_error;
         }
 
-        if (!network[i].weights || !network[i].bias) {
+        if ((!network[i].weights && dtype != WEIGHTS_INT8) || !network[i].bias) {
             die("nn_network_read_weights() Error: "
                 "the weights on layer %zu haven't been initialized", i);
         }
-
-        ret = fread(network[i].weights, sizeof(double), shape[0] * shape[1], fp);
-        if (ret != shape[0] * shape[1]) goto nn_network_read_weights_error;
-
-        ret = fread(network[i].bias, sizeof(double), shape[1], fp);
-        if (ret != shape[1]) goto nn_network_read_weights_error;
+        if (!read_layer_values(fp, &network[i], dtype, sparse)) goto nn_network_read_weights_error;
     }
 
     fclose(fp);
@@ -385,26 +507,126 @@ nn_network_read_weights_error:
         "number of read objects does not match with expected ones");
 }
 
+/* Number of layers stored on a weights file, neurons gets the width of each one */
+size_t nn_network_read_layers(char *filepath, size_t **neurons)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL) die("nn_network_read_layers() Error:");
+
+    bool sparse;
+    uint32_t dtype = read_weights_header(fp, filepath, &sparse);
+    size_t net_size, shape[2];
+
+    if (fread(&net_size, sizeof(size_t), 1, fp) != 1 || net_size == 0) goto nn_network_read_layers_error;
+    *neurons = ecalloc(net_size, sizeof(size_t));
+
+    // layers are read to get past them, their size depends on the format
+    for (size_t i = 0; i < net_size; i++) {
+        if (fread(shape, sizeof(size_t), 2, fp) != 2) goto nn_network_read_layers_error;
+
+        Layer layer = {.neurons = shape[1]};
+        if (dtype == WEIGHTS_INT8) nn_network_init_bias(&layer, 1, shape[0]);
+        else nn_network_init_weights(&layer, 1, shape[0], false);
+        bool ok = read_layer_values(fp, &layer, dtype, sparse);
+        nn_network_free_weights(&layer, 1);
+        if (!ok) goto nn_network_read_layers_error;
+
+        (*neurons)[i] = shape[1];
+    }
+    fclose(fp);
+    return net_size;
+
+nn_network_read_layers_error:
+    fclose(fp);
+    die("nn_network_read_layers() Error: '%s' is not a weights file", filepath);
+    return 0;
+}
+
+/* Value size of the weights file, files without header hold doubles */
+uint32_t read_weights_header(FILE *fp, char *filepath, bool *sparse)
+{
+    char magic[4];
+    uint32_t dtype = sizeof(double);
+
+    *sparse = false;
+    if (fread(magic, 1, 4, fp) == 4 && !memcmp(magic, WEIGHTS_MAGIC, 4)) {
+        size_t ret = fread(&dtype, sizeof(uint32_t), 1, fp);
+        *sparse = dtype & WEIGHTS_SPARSE;
+        dtype &= ~WEIGHTS_SPARSE;
+        if (ret != 1 || (dtype != sizeof(float) && dtype != sizeof(double) && dtype != WEIGHTS_INT8)) {
+            die("nn_network_read_weights() Error: unknown value size on '%s'", filepath);
+        }
+    } else rewind(fp);
+    return dtype;
+}
+
+bool read_layer_values(FILE *fp, Layer *layer, uint32_t dtype, bool sparse)
+{
+    if (dtype == WEIGHTS_INT8) return nn_layer_read_int8(fp, layer);
+    if (sparse) return nn_layer_read_sparse(fp, layer, dtype);
+
+    // the bias follows the weights both on the file and on the slab
+    size_t size = layer->input_nodes * layer->neurons + layer->neurons;
+    return nn_read_values(fp, layer->weights, size, dtype) == size;
+}
+
+/* Whether filepath holds int8 weights, see nn_network_init_bias() */
+bool nn_network_is_int8(char *filepath)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL) die("nn_network_is_int8() Error:");
+
+    bool sparse;
+    uint32_t dtype = read_weights_header(fp, filepath, &sparse);
+    fclose(fp);
+    return dtype == WEIGHTS_INT8;
+}
+
+/* Inputs of the first layer stored on a weights file */
+size_t nn_network_read_input_nodes(char *filepath)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL) die("nn_network_read_input_nodes() Error:");
+
+    char magic[4];
+    uint32_t dtype;
+    size_t net_size, shape[2];
+
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, WEIGHTS_MAGIC, 4)) rewind(fp);
+    else if (fread(&dtype, sizeof(uint32_t), 1, fp) != 1) goto nn_network_read_input_nodes_error;
+
+    if (fread(&net_size, sizeof(size_t), 1, fp) != 1 || fread(shape, sizeof(size_t), 2, fp) != 2) {
+        goto nn_network_read_input_nodes_error;
+    }
+    fclose(fp);
+    return shape[0];
+
+nn_network_read_input_nodes_error:
+    fclose(fp);
+    die("nn_network_read_input_nodes() Error: '%s' is not a weights file", filepath);
+    return 0;
+}
+
 void nn_network_write_weights(char *filepath, Layer *network, size_t network_size)
 {
     FILE *fp = fopen(filepath, "wb");
     if (fp == NULL) die("nn_network_write_weights() Error:");
 
+    uint32_t dtype = sizeof(nn_float);
+    fwrite(WEIGHTS_MAGIC, 1, 4, fp);
+    fwrite(&dtype, sizeof(uint32_t), 1, fp);
     fwrite(&network_size, sizeof(size_t), 1, fp);
 
     size_t ret;
     for (size_t i = 0; i < network_size; i++) {
         size_t shape[2] = {network[i].input_nodes, network[i].neurons};
-        size_t size = shape[0] * shape[1];
+        size_t size = shape[0] * shape[1] + shape[1];
 
         ret = fwrite(shape, sizeof(size_t), 2, fp);
         if (ret != 2) goto nn_network_write_weights_error;
 
-        ret = fwrite(network[i].weights, sizeof(double), size, fp);
+        ret = fwrite(network[i].weights, sizeof(nn_float), size, fp);
         if (ret != size) goto nn_network_write_weights_error;
-
-        ret = fwrite(network[i].bias, sizeof(double), network[i].neurons, fp);
-        if (ret != network[i].neurons) goto nn_network_write_weights_error;
     }
     fclose(fp);
     return;
@@ -415,42 +637,96 @@ nn_network_write_weights_error:
         "number of written objects does not match with number of objects");
 }
 
+/* read n values stored with dtype bytes each into dest */
+size_t nn_read_values(FILE *fp, nn_float *dest, size_t n, uint32_t dtype)
+{
+    size_t i;
+
+    if (dtype == sizeof(nn_float)) return fread(dest, sizeof(nn_float), n, fp);
+
+    if (dtype == sizeof(float)) {
+        float value;
+        for (i = 0; i < n && fread(&value, sizeof(float), 1, fp); i++) dest[i] = value;
+    } else {
+        double value;
+        for (i = 0; i < n && fread(&value, sizeof(double), 1, fp); i++) dest[i] = value;
+    }
+    return i;
+}
+
 void nn_network_init_weights(Layer layers[], size_t nmemb, size_t n_inputs, bool fill_random)
 {
     size_t i, prev_size = n_inputs;
 
+    for (i = 0; i < nmemb; i++) {
+        layers[i].input_nodes = prev_size;
+        prev_size = layers[i].neurons;
+    }
+
+    nn_float *params = ealigned_calloc(PARAMS_ALIGN, nn_network_params_size(layers, nmemb), sizeof(nn_float));
+    layers[0].params = params;
 
-    for (i = 0; i < nmemb;  i++) {
-        layers[i].weights = calloc(prev_size * layers[i].neurons, sizeof(double));
-        layers[i].bias = calloc(layers[i].neurons, sizeof(double));
+    for (i = 0; i < nmemb; i++) {
+        size_t rows = layers[i].input_nodes, cols = layers[i].neurons;
+        layers[i].weights = params;
+        layers[i].bias = params + rows * cols;
+        params += params_block_size(rows, cols);
 
-        if (layers[i].weights == NULL || layers[i].bias == NULL) {
-            goto nn_layers_calloc_weights_error;
-        }
+        if (fill_random) fill_random_weights(layers[i].weights, layers[i].bias, rows, cols);
+    }
+}
 
-        if (fill_random) fill_random_weights(layers[i].weights, layers[i].bias, prev_size, layers[i].neurons);
+/* Slab of int8 networks, their weights are on qweights so it only holds the bias */
+void nn_network_init_bias(Layer layers[], size_t nmemb, size_t n_inputs)
+{
+    size_t i, size = 0, prev_size = n_inputs;
 
+    for (i = 0; i < nmemb; i++) {
         layers[i].input_nodes = prev_size;
         prev_size = layers[i].neurons;
+        size += params_block_size(0, layers[i].neurons);
     }
 
-    return;
+    nn_float *params = ealigned_calloc(PARAMS_ALIGN, size, sizeof(nn_float));
+    layers[0].params = params;
+    for (i = 0; i < nmemb; i++) {
+        layers[i].weights = NULL;
+        layers[i].bias = params;
+        params += params_block_size(0, layers[i].neurons);
+    }
+}
 
-nn_layers_calloc_weights_error:
-    perror("nn_layers_calloc_weights() Error");
-    exit(1);
+/* Number of values on the parameters slab, copies of it share the layers offsets */
+size_t nn_network_params_size(Layer layers[], size_t nmemb)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < nmemb; i++)
+        size += params_block_size(layers[i].input_nodes, layers[i].neurons);
+    return size;
 }
 
 void nn_network_free_weights(Layer layers[], size_t nmemb)
 {
     size_t i;
+    if (nmemb) free(layers[0].params);
     for (i = 0; i < nmemb; i++) {
-        free(layers[i].weights);
-        free(layers[i].bias);
+        free(layers[i].qweights);
+        free(layers[i].qscales);
+        free(layers[i].mask);
+        free(layers[i].sparse_weights.indptr);
+        free(layers[i].sparse_weights.indices);
+        free(layers[i].sparse_weights.values);
     }
 }
 
-void fill_random_weights(double *weights, double *bias, size_t rows, size_t cols)
+/* weights and bias of a layer rounded up to the next PARAMS_ALIGN boundary */
+size_t params_block_size(size_t rows, size_t cols)
+{
+    size_t align = PARAMS_ALIGN / sizeof(nn_float);
+    return (rows * cols + cols + align - 1) / align * align;
+}
+
+void fill_random_weights(nn_float *weights, nn_float *bias, size_t rows, size_t cols)
 {
     FILE *fp = fopen("/dev/random", "rb");
     if (fp == NULL) goto nn_fill_random_weights_error;
@@ -482,53 +758,7 @@ nn_fill_random_weights_error:
     exit(1);
 }
 
-void dataset_shuffle_rows(
-        double *inputs, size_t in_shape[2],
-        double *labels, size_t lbl_shape[2])
-{
-    size_t random_row;
-    size_t in_index, lbl_index;
-    size_t shuffle_in_index, column_in_bytes;
-    size_t shuffle_lbl_index, column_lbl_bytes;
-    double *in_buffer, *lbl_buffer;
-
-    in_buffer = malloc(sizeof(double) * in_shape[1]);
-    lbl_buffer = malloc(sizeof(double) * lbl_shape[1]);
-
-    if (in_buffer == NULL || lbl_buffer == NULL)
-        goto dataset_shuffle_rows_error;
-
-    column_in_bytes = sizeof(double) * in_shape[1];
-    column_lbl_bytes = sizeof(double) * lbl_shape[1];
-    for (size_t row = 0; row < in_shape[0]; row++) {
-        /* Swap actual row with a random row*/
-        random_row = random() % in_shape[0];
-
-        /* Input Swap */
-        in_index = row * in_shape[1];
-        shuffle_in_index = random_row * in_shape[1];
-        memcpy(in_buffer, inputs + in_index, column_in_bytes);
-        memcpy(inputs + in_index, inputs + shuffle_in_index, column_in_bytes);
-        memcpy(inputs + shuffle_in_index, in_buffer, column_in_bytes);
-
-        /* Label Swap */
-        lbl_index = row * lbl_shape[1];
-        shuffle_lbl_index = random_row * lbl_shape[1];
-        memcpy(lbl_buffer, labels + lbl_index, column_lbl_bytes);
-        memcpy(labels + lbl_index, labels + shuffle_lbl_index, column_lbl_bytes);
-        memcpy(labels + shuffle_lbl_index, lbl_buffer, column_lbl_bytes);
-
-    }
-
-    free(in_buffer);
-    free(lbl_buffer);
-    return;
-
-dataset_shuffle_rows_error:
-    die("dataset_shuffle_rows() malloc Error:");
-}
-
-double square_loss(double labels[], double net_out[], size_t shape)
+nn_float square_loss(nn_float labels[], nn_float net_out[], size_t shape)
 {
     double sum = 0;
     for (size_t i = 0; i < shape; i++) {
@@ -537,20 +767,20 @@ double square_loss(double labels[], double net_out[], size_t shape)
     return 0.5 * sum;
 }
 
-double square_dloss_out(double label, double net_out)
+nn_float square_dloss_out(nn_float label, nn_float net_out)
 {
     return net_out - label;
 }
 
-double get_avg_loss(
-        double labels[], double outs[], size_t shape[2],
-        double (*loss)(double *, double *, size_t shape))
+nn_float get_avg_loss(
+        Tensor *labels, Tensor *outs,
+        nn_float (*loss)(nn_float *, nn_float *, size_t shape))
 {
     double sum = 0;
-    for (size_t i = 0; i < shape[0]; i += shape[1]) {
-        sum += loss(labels + i, outs + i, shape[1]);
+    for (size_t i = 0; i < labels->shape[0]; i++) {
+        sum += loss(TENSOR_ROW(*labels, i), TENSOR_ROW(*outs, i), labels->shape[1]);
     }
-    return sum / shape[0];
+    return sum / labels->shape[0];
 }
 
 struct Cost load_loss(struct Configs cfg)
@@ -562,20 +792,20 @@ struct Cost load_loss(struct Configs cfg)
 
 #ifdef NN_TEST
 /*
- * compile: clang -Wall -Wextra -g -DNN_TEST -o objs/test_nn src/util.c src/nn.c $(pkg-config --libs-only-l blas) -lm
+ * compile: clang -Wall -Wextra -g -DNN_TEST -o objs/test_nn src/util.c src/nn.c src/activations.c src/quant.c src/prune.c src/blas.c src/tensor.c src/dataset.c src/loader.c src/parse.c src/dtoa.c $(pkg-config --libs-only-l openblas json-c) -lm -lpthread
  */
 int main(void) {
     /*
      * array_shuffle_rows() test
      */
     srandom(42);
-    double input_array[12] = {
+    nn_float input_array[12] = {
         11, 12, 13,
         21, 22, 23,
         31, 32, 33,
         41, 42, 43,
     };
-    double shuffled_input_array[12] = {
+    nn_float shuffled_input_array[12] = {
         21, 22, 23,
         41, 42, 43,
         31, 32, 33,
@@ -583,11 +813,13 @@ int main(void) {
     };
     size_t in_shape[2] = {4,3};
 
-    double label_array[4] = {1, 2, 3, 4};
-    double shuffled_label_array[4] = {2, 4, 3, 1};
+    nn_float label_array[4] = {1, 2, 3, 4};
+    nn_float shuffled_label_array[4] = {2, 4, 3, 1};
     size_t lbl_shape[2] = {4,1};
 
-    dataset_shuffle_rows(input_array, in_shape, label_array, lbl_shape);
+    Tensor input_tensor = tensor_wrap(input_array, in_shape[0], in_shape[1], in_shape[1]);
+    Tensor label_tensor = tensor_wrap(label_array, lbl_shape[0], lbl_shape[1], lbl_shape[1]);
+    dataset_shuffle_rows(&input_tensor, &label_tensor);
     size_t i, j, index;
     for (i = 0; i < in_shape[0]; i++) {
         for (j = 0; j < in_shape[1]; j++) {
@@ -608,6 +840,39 @@ int main(void) {
     }
     printf("- array_shuffle_rows() success\n");
 
+    /*
+     * nn_network_init_weights() slab layout test
+     */
+    Layer network[3] = {{.neurons = 5}, {.neurons = 3}, {.neurons = 1}};
+    nn_network_init_weights(network, 3, 7, false);
+    for (i = 0; i < 3; i++) {
+        if ((uintptr_t)network[i].weights % PARAMS_ALIGN
+            || network[i].bias != network[i].weights + network[i].input_nodes * network[i].neurons) {
+            printf("- nn_network_init_weights() failure: layer %zu block is misplaced\n", i);
+            return 1;
+        }
+    }
+    if (network[2].bias + 1 > network[0].params + nn_network_params_size(network, 3)) {
+        printf("- nn_network_init_weights() failure: slab is smaller than its layers\n");
+        return 1;
+    }
+    nn_network_free_weights(network, 3);
+    printf("- nn_network_init_weights() success\n");
+
+    /*
+     * internal blas_gemm() and blas_ger() keep the 0 * inf terms test
+     */
+    nn_float a_zeros[33] = {0}, b_col[33] = {INFINITY}, c_out = 0, a_out = 0;
+    nn_float x_zero = 0, y_inf = INFINITY;
+    blas_init("internal", 1);
+    blas_gemm(1, 1, 33, 1, a_zeros, 33, b_col, 1, 0, &c_out, 1);
+    blas_ger(1, 1, 1, &x_zero, &y_inf, &a_out, 1);
+    if (!isnan(c_out) || !isnan(a_out)) {
+        printf("- blas_gemm() failure: 0 * inf terms were skipped\n");
+        return 1;
+    }
+    printf("- blas_gemm() success\n");
+
     return 0;
 }
 #endif //NN_TEST
@@ -21,81 +21,200 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
 
 #include "util.h"
+#include "tensor.h"
+
+#define WEIGHTS_MAGIC "MLWT"
+#define WEIGHTS_INT8 1
+#define WEIGHTS_SPARSE 0x100 // flag on the value size of pruned weights files
+
+/*
+ * Vector kernels (activations, int8 products), x86_64 builds carry AVX2 and AVX-512
+ * clones picked at load time, CPUFLAGS=-march=native makes them the only path.
+ */
+#if defined(__AVX512F__)
+#define VEC_BYTES 64
+#else
+#define VEC_BYTES 32
+#endif
+
+#if defined(__x86_64__) && !defined(__AVX2__) && !defined(__SANITIZE_ADDRESS__)
+#define KERNEL_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define KERNEL_CLONES
+#endif
 
 struct Cost {
-    double (*func)(double labels[], double net_out[], size_t shape);
-    double (*dfunc_out)(double labels, double net_out);
+    nn_float (*func)(nn_float labels[], nn_float net_out[], size_t shape);
+    nn_float (*dfunc_out)(nn_float labels, nn_float net_out);
 };
 
-struct Activation {
-    double (*func)(double);
-    double (*dfunc)(double);
+enum ActivationType {
+    NN_LINEAR,
+    NN_RELU,
+    NN_LEAKY_RELU,
+    NN_SIGMOID,
+    NN_SOFTPLUS,
+    NN_TANH,
 };
 
+/* CSR matrix, row i values are on [indptr[i], indptr[i + 1]) */
+typedef struct Sparse {
+    size_t *indptr;
+    size_t *indices;
+    nn_float *values;
+    size_t shape[2];
+} Sparse;
+
+/* each layer parameters block starts on this boundary inside the network slab */
+#define PARAMS_ALIGN 64
+
+/*
+ * weights and bias are views of one slab owned by the first layer (params), each
+ * layer block holds its weights followed by its bias. qweights are only set by
+ * int8 weights files and sparse_weights by sparse layers on predictions, both
+ * replace weights. mask keeps pruned weights at zero on training.
+ */
 typedef struct Layer {
-    double *weights, *bias;
-    struct Activation activation;
+    nn_float *weights, *bias;
+    nn_float *params;
+    int8_t *qweights;
+    float *qscales, qinput_scale;
+    Sparse sparse_weights;
+    uint8_t *mask;
+    enum ActivationType activation;
     size_t neurons, input_nodes;
 } Layer;
 
+Layer * load_network(struct Configs cfg);
 void nn_network_write_weights(char *filepath, Layer *network, size_t network_size);
 void nn_network_read_weights(char *filepath, Layer *network, size_t network_size);
 void nn_network_init_weights(Layer *network, size_t nmemb, size_t input_cols, bool fill_random);
+void nn_network_init_bias(Layer *network, size_t nmemb, size_t input_cols);
 void nn_network_free_weights(Layer *network, size_t nmemb);
+size_t nn_network_params_size(Layer *network, size_t nmemb);
 
+/* sparse_input replaces the input values, input data is then NULL but keeps the shape */
 void nn_network_predict(
-        double *out, size_t out_shape[2],
-        double *input, size_t input_shape[2],
+        Tensor *out,
+        Tensor *input,
+        Sparse *sparse_input,
         Layer network[], size_t network_size);
 
 void nn_network_train(
         Layer network[], struct Configs ml_configs,
-        double *input, size_t input_shape[2],
-        double *labels, size_t labels_shape[2]);
-
-void nn_layer_map_activation(
-        double (*activation)(double),
-        double *aout, size_t aout_shape[2],
-        double *zout, size_t zout_shape[2]);
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels);
 
+/* rows indexes the rows trained on, input and labels are shared as they are */
+void nn_network_train_rows(
+        Layer network[], struct Configs ml_configs,
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels,
+        size_t *rows, size_t n_rows);
 
-double sigmoid(double x);
-double relu(double x);
-double identity(double x);
+nn_float nn_network_loss(
+        Layer network[], struct Configs ml_configs,
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels);
 
+/* ds is a dataset file open with dataset_open() */
+struct Dataset;
+void nn_network_train_stream(Layer network[], struct Configs ml_configs, struct Dataset *ds);
 
+void nn_network_quantize(
+        Layer network[], size_t network_size,
+        Tensor *input,
+        Sparse *sparse_input);
+
+void nn_network_export_c(char *filepath, Layer network[], size_t network_size, struct Configs cfg);
+size_t nn_network_read_input_nodes(char *filepath);
+bool nn_network_is_int8(char *filepath);
+size_t nn_network_read_layers(char *filepath, size_t **neurons);
+
+void nn_network_write_weights_int8(char *filepath, Layer *network, size_t network_size);
+bool nn_layer_read_int8(FILE *fp, Layer *layer);
+size_t nn_read_values(FILE *fp, nn_float *dest, size_t n, uint32_t dtype);
+
+void nn_network_prune(Layer network[], size_t network_size, double sparsity);
+void nn_network_sparsify(Layer network[], size_t network_size, double density);
+void nn_network_write_weights_sparse(char *filepath, Layer *network, size_t network_size);
+bool nn_layer_read_sparse(FILE *fp, Layer *layer, uint32_t dtype);
+void nn_layer_apply_mask(Layer layer, nn_float *weights);
+
+void nn_activation_fast(bool enable);
+void nn_activation_epilogue(
+        enum ActivationType type,
+        nn_float *out, nn_float *dout, const nn_float *bias,
+        size_t n);
+
+/* outs and douts rows can exceed the input ones, only the first input rows are written */
 void nn_forward(
-        double **aout, double **zout,
-        double *input, size_t input_shape[2],
+        Tensor aout[], Tensor dout[],
+        Tensor *input,
+        Sparse *sparse_input,
         Layer network[], size_t network_size);
 
 void nn_backward(
-        double **weights, double **bias,
-        double **zout, double **outs,
-        double *input, size_t input_shape[2],
-        double *labels, size_t labels_shape[2],
+        nn_float **weights, nn_float **bias,
+        Tensor douts[], Tensor outs[],
+        Tensor *input,
+        Sparse *sparse_input,
+        Tensor *labels,
         Layer network[], size_t network_size,
-        double (cost_derivative)(double, double),
-        double alpha);
+        nn_float (cost_derivative)(nn_float, nn_float),
+        nn_float alpha);
 
 void nn_layer_forward(
         Layer layer,
-        double *out, size_t out_shape[2],
-        double *input, size_t input_shape[2]);
+        Tensor *out, Tensor *dout,
+        Tensor *input);
+
+void nn_layer_forward_sparse(
+        Layer layer,
+        Tensor *out, Tensor *dout,
+        Sparse *input);
+
+void nn_layer_forward_int8(
+        Layer layer,
+        Tensor *out,
+        Tensor *input);
+
+void nn_layer_forward_sparse_int8(
+        Layer layer,
+        Tensor *out,
+        Sparse *input);
+
+void nn_layer_forward_csr(
+        Layer layer,
+        Tensor *out,
+        Tensor *input);
+
+void nn_layer_forward_sparse_csr(
+        Layer layer,
+        Tensor *out,
+        Sparse *input);
 
 void nn_layer_backward(
-        double *weights, double *bias, size_t weigths_shape[2],
-        double *delta, double *out_prev,
-        double alpha);
+        nn_float *weights, nn_float *bias, size_t weigths_shape[2],
+        nn_float *delta, nn_float *out_prev,
+        nn_float alpha);
+
+void nn_layer_backward_sparse(
+        nn_float *weights, nn_float *bias, size_t weigths_shape[2],
+        nn_float *delta, Sparse *input, size_t row,
+        nn_float alpha);
 
 void nn_layer_out_delta(
-        double *delta, double *dcost_out, double *zout, size_t cols,
-        double (*activation_derivative)(double));
+        nn_float *delta, nn_float *dcost_out, nn_float *dout, size_t cols);
 
 void nn_layer_hidden_delta(
-        double *delta, double *delta_next, double *zout,
-        double *weights_next, size_t weights_next_shape[2],
-        double (*activation_derivative)(double));
+        nn_float *delta, nn_float *delta_next, nn_float *dout,
+        nn_float *weights_next, size_t weights_next_shape[2]);
 #endif
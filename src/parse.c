@@ -17,8 +17,10 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 #include <json-c/json.h>
 #include <errno.h>
 
@@ -26,6 +28,44 @@
 #include "parse.h"
 
 #define MAX_FILE_SIZE 536870912 //1<<29; 0.5 GiB
+#define BUFFER_SIZE 1048576 //1<<20; 1 MiB
+
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+enum JsonStyle {
+    JSON_PRETTY,
+    JSON_COMPACT,
+    JSON_LINES
+};
+
+struct JsonTokens {
+    const char *array_open, *array_close, *object_open, *object_close;
+    const char *object_sep, *field_sep, *key_sep;
+};
+
+static const struct JsonTokens JSON_TOKENS[] = {
+    [JSON_PRETTY] = {"[\n", "\n]\n", "  {\n    ", "\n  }", ",\n", ",\n    ", ": "},
+    [JSON_COMPACT] = {"[", "]\n", "{", "}", ",", ",", ":"},
+    [JSON_LINES] = {"", "", "{", "}\n", "", ",", ":"},
+};
+
+/* Output is formatted on memory and written on big chunks */
+struct Buffer {
+    FILE *fp;
+    char *data;
+    size_t size, capacity;
+};
+
+static void buffer_flush(struct Buffer *buffer);
+static void buffer_write(struct Buffer *buffer, const char *data, size_t size);
+static void buffer_json_string(struct Buffer *buffer, const char *string);
+static void buffer_json_double(struct Buffer *buffer, double value, int precision);
+static int format_digits(char *out, bool negative, const char *digits, int n, int exponent, int precision);
+static int format_general(char *out, double value, int precision);
+static int format_double(char *out, double value, int precision);
 
 static void json_read(
         FILE *fp,
@@ -42,22 +82,39 @@ static void csv_read(
         char *separator
         );
 
-static void json_write(
+static void libsvm_read(
         FILE *fp,
+        Sparse *input, Array *out,
+        struct Configs cfgs,
+        bool read_output
+        );
+
+
+static void array_reserve(Array *x, size_t rows);
+#ifndef NN_FLOAT32
+static void array_view(Array *x, double *matrix, size_t rows, size_t ld);
+#endif
+
+static void json_write(
+        FileWriter *writer,
         Array input, Array out,
-        struct Configs cfgs
+        struct Configs cfgs,
+        enum JsonStyle style
         );
 
 static void csv_write(
-        FILE *fp,
+        FileWriter *writer,
         Array input, Array out,
         struct Configs cfgs,
         char *separator
         );
 
+static void csv_write_header(struct Buffer *buffer, struct Configs cfgs, bool write_input, char *separator);
+static enum JsonStyle json_style(char *file_format, struct Configs cfgs);
+
 void file_read(
         char *filepath,
-        Array *input, Array *out,
+        Array *input, Sparse *sparse_input, Array *out,
         struct Configs ml_config,
         bool read_output)
 {
@@ -82,7 +139,11 @@ void file_read(
     if (!strcmp(file_format, "csv"))        csv_read(fp, input, out, ml_config, read_output, ",");
     else if (!strcmp(file_format, "tsv"))   csv_read(fp, input, out, ml_config, read_output, "\t");
     else if (!strcmp(file_format, "json"))  json_read(fp, input, out, ml_config, read_output);
-    else {
+    else if (!strcmp(file_format, "libsvm") || !strcmp(file_format, "svm")) {
+        libsvm_read(fp, sparse_input, out, ml_config, read_output);
+        array_set_fields(input, NULL, 0, ml_config);
+        input->shape[0] = sparse_input->shape[0];
+    } else {
         die("file_read() Error: unable to parse %s files", file_format);
     }
 
@@ -91,72 +152,114 @@ void file_read(
 
 void file_write(Array input, Array out, struct Configs ml_config)
 {
-    FILE *fp;
+    FileWriter writer;
 
+    file_writer_open(&writer, ml_config);
+    file_writer_write(&writer, input, out, ml_config);
+    file_writer_close(&writer, ml_config);
+}
+
+/* Output file written by chunks of rows, file_write() writes it on a single one */
+void file_writer_open(FileWriter *writer, struct Configs ml_config)
+{
     char *filepath = ml_config.out_filepath;
     char *file_format = ml_config.file_format;
 
     if (filepath != NULL && strcmp(filepath, "-")) {
-        fp = fopen(filepath, "w");
+        writer->fp = fopen(filepath, "w");
         file_format = file_format_infer(filepath);
     } else {
-        fp = fopen("/dev/stdout", "w");
+        writer->fp = fopen("/dev/stdout", "w");
         if (file_format == NULL) {
             die("file_write() Error: file format must be defined");
         }
     }
 
-    if (fp == NULL) die("file_write() Error:");
-
-    if (!strcmp(file_format, "json"))       json_write(fp, input, out, ml_config);
-    else if (!strcmp(file_format, "csv"))   csv_write(fp, input, out, ml_config, ",");
-    else if (!strcmp(file_format, "tsv"))   csv_write(fp, input, out, ml_config, "\t");
-    else {
+    if (writer->fp == NULL) die("file_write() Error:");
+    if (strcmp(file_format, "json") && strcmp(file_format, "ndjson")
+        && strcmp(file_format, "csv") && strcmp(file_format, "tsv")) {
         die("file_write() Error: unable to write %s files", file_format);
     }
-    fclose(fp);
+    writer->file_format = file_format;
+    writer->rows = 0;
+    writer->started = false;
+}
+
+void file_writer_write(FileWriter *writer, Array input, Array out, struct Configs ml_config)
+{
+    char *file_format = writer->file_format;
+
+    if (!strcmp(file_format, "csv"))        csv_write(writer, input, out, ml_config, ",");
+    else if (!strcmp(file_format, "tsv"))   csv_write(writer, input, out, ml_config, "\t");
+    else json_write(writer, input, out, ml_config, json_style(file_format, ml_config));
+}
+
+void file_writer_close(FileWriter *writer, struct Configs ml_config)
+{
+    struct Buffer buffer = {.fp = writer->fp, .data = ecalloc(BUFFER_SIZE, 1), .capacity = BUFFER_SIZE};
+    char *file_format = writer->file_format;
+    bool csv = !strcmp(file_format, "csv"), tsv = !strcmp(file_format, "tsv");
+
+    if (csv || tsv) {
+        if (!writer->started) {
+            csv_write_header(&buffer, ml_config, !ml_config.only_out && ml_config.n_input_keys > 0, (csv) ? "," : "\t");
+        }
+    } else {
+        enum JsonStyle style = json_style(file_format, ml_config);
+        const char *array_close = JSON_TOKENS[style].array_close;
+
+        if (!writer->started) buffer_write(&buffer, JSON_TOKENS[style].array_open, strlen(JSON_TOKENS[style].array_open));
+        if (style == JSON_PRETTY && writer->rows == 0) array_close = "]\n";
+        buffer_write(&buffer, array_close, strlen(array_close));
+    }
+    buffer_flush(&buffer);
+    free(buffer.data);
+    if (fclose(writer->fp) == EOF) die("file_write() Error:");
+}
+
+enum JsonStyle json_style(char *file_format, struct Configs cfgs)
+{
+    if (!strcmp(file_format, "ndjson")) return JSON_LINES;
+    return (cfgs.compact) ? JSON_COMPACT : JSON_PRETTY;
 }
 
 void data_postprocess(
         Array *out,
-        double *data, size_t data_shape[2],
+        Tensor *data,
         struct Configs cfgs,
         bool is_input)
 {
     char **keys = (is_input) ? cfgs.input_keys : cfgs.label_keys;
     size_t n_keys = (is_input) ? cfgs.n_input_keys : cfgs.n_label_keys;
 
-    char **categorical_keys = cfgs.categorical_keys;
-    size_t n_categorical_keys = cfgs.n_categorical_keys;
+    nn_float *column;
+    size_t i, j, data_j;
 
-    char ***categorical_values = cfgs.categorical_values;
-    size_t *n_categorical_values = cfgs.n_categorical_values;
+#ifndef NN_FLOAT32
+    if (out->row_major) {
+        array_view(out, data->data, data->shape[0], data->ld);
+        return;
+    }
+#endif
+
+    if (out->capacity < data->shape[0]) array_reserve(out, data->shape[0]);
+    out->shape[0] = data->shape[0];
 
-    size_t i, j, data_j;
     for (data_j = j = 0; j < n_keys; j++) {
-        int k;
         switch (out->type[j]) {
         case ARRAY_NUMERICAL:
-            for (i = 0; i < data_shape[0]; i++) {
-                size_t data_index = i * data_shape[1] + data_j;
-                size_t index = i * out->shape[1] + j;
-                out->data[index].numeric = data[data_index];
+            column = data->data + data_j;
+            for (i = 0; i < data->shape[0]; i++) {
+                out->columns[j].numeric[i * out->stride] = column[i * data->ld];
             }
             data_j++;
             break;
         case ARRAY_ONEHOT:
-            k = util_get_key_index(keys[j], categorical_keys, n_categorical_keys);
-            if (k == -1) {
-                die("data_postprocess() Error: field '%s' is not registered as categorical",
-                    keys[j]);
-            }
-            for (i = 0; i < data_shape[0]; i++) {
-                size_t index = i * out->shape[1] + j;
-                size_t data_index = i * data_shape[1] + data_j;
-                int onehot_i = util_argmax(data + data_index, n_categorical_values[k]);
-                out->data[index].categorical = e_strdup(categorical_values[k][onehot_i]);
+            column = data->data + data_j;
+            for (i = 0; i < data->shape[0]; i++) {
+                out->columns[j].categorical[i] = util_argmax(column + i * data->ld, out->n_values[j]);
             }
-            data_j += n_categorical_values[k];
+            data_j += out->n_values[j];
             break;
         default:
             die("data_postprocess() Error: unexpected type received on '%s' field", keys[j]);
@@ -164,38 +267,36 @@ void data_postprocess(
     }
 }
 
-double * data_preprocess(
-        size_t out_shape[2],
-        Array data,
+Tensor data_preprocess(
+        Array *data,
         struct Configs cfgs,
         bool is_input,
         bool only_allocate)
 {
-    double *out;
+    Tensor out;
 
     char **keys = (is_input) ? cfgs.input_keys : cfgs.label_keys;
     size_t n_keys = (is_input) ? cfgs.n_input_keys : cfgs.n_label_keys;
 
-    char **categorical_keys = cfgs.categorical_keys;
-    size_t n_categorical_keys = cfgs.n_categorical_keys;
+    nn_float *column;
+    size_t i, j, out_j, cols = 0;
 
-    char ***categorical_values = cfgs.categorical_values;
-    size_t *n_categorical_values = cfgs.n_categorical_values;
-
-    size_t i, j, out_j;
+#ifndef NN_FLOAT32
+    /* numeric only data is already a design matrix, hand it over */
+    if (data->row_major && data->matrix && !only_allocate) {
+        out = tensor_wrap(data->matrix, data->shape[0], data->shape[1], data->stride);
+        data->matrix = NULL;
+        return out;
+    }
+#endif
 
-    out_shape[0] = data.shape[0];
-    out_shape[1] = 0;
     for (i = 0; i < n_keys; i++) {
-        int n;
-        switch (data.type[i]) {
+        switch (data->type[i]) {
         case ARRAY_NUMERICAL:
-            out_shape[1]++;
+            cols++;
             break;
         case ARRAY_ONEHOT:
-            n = util_get_key_index(keys[i], categorical_keys, n_categorical_keys);
-            if (n == -1) die("data_preprocess() Error: field '%s' is not marked as categorical", keys[i]);
-            out_shape[1] += n_categorical_values[n];
+            cols += data->n_values[i];
             break;
         default:
             die("data_preprocess() Error: field '%s' has an unknown type", keys[i]);
@@ -203,36 +304,24 @@ double * data_preprocess(
         }
     }
 
-    out = ecalloc(out_shape[0] * out_shape[1], sizeof(double));
+    out = tensor_alloc(data->shape[0], cols);
     if (only_allocate) return out;
 
-    for (out_j = j = 0; j < data.shape[1]; j++) {
-        switch (data.type[j]) {
-            int k;
+    for (out_j = j = 0; j < data->shape[1]; j++) {
+        switch (data->type[j]) {
             case ARRAY_NUMERICAL:
-                for (i = 0; i < out_shape[0]; i++) {
-                    size_t index = i * data.shape[1] + j;
-                    size_t out_index = i * out_shape[1] + out_j;
-                    out[out_index] = data.data[index].numeric;
+                column = out.data + out_j;
+                for (i = 0; i < out.shape[0]; i++) {
+                    column[i * out.ld] = data->columns[j].numeric[i * data->stride];
                 }
                 out_j++;
                 break;
             case ARRAY_ONEHOT:
-                k = util_get_key_index(keys[j], categorical_keys, n_categorical_keys);
-                for (i = 0; i < out_shape[0]; i++) {
-                    int onehot_i;
-                    size_t index = i * data.shape[1] + j;
-                    onehot_i = util_get_key_index(data.data[index].categorical,
-                                                  categorical_values[k],
-                                                  n_categorical_values[k]);
-                    if (onehot_i == -1) {
-                        die("data_preprocess() Error: unexpected '%s' value found",
-                            data.data[index].categorical);
-                    }
-                    size_t out_index = i * out_shape[1] + out_j + onehot_i;
-                    out[out_index] = 1.0;
+                column = out.data + out_j;
+                for (i = 0; i < out.shape[0]; i++) {
+                    column[i * out.ld + data->columns[j].categorical[i]] = 1.0;
                 }
-                out_j += n_categorical_values[k];
+                out_j += data->n_values[j];
                 break;
             default:
                 die("data_preprocess() Error: field '%s' has an unknown type", keys[j]);
@@ -242,23 +331,162 @@ double * data_preprocess(
     return out;
 }
 
+/*
+ * Onehot fields are stored as their column index on the design matrix,
+ * numeric zeros are not stored
+ */
+void data_preprocess_sparse(
+        Sparse *out,
+        Array *data,
+        struct Configs cfgs)
+{
+    size_t i, j, out_j, nnz;
+
+    out->shape[0] = data->shape[0];
+    out->shape[1] = 0;
+    for (j = 0; j < data->shape[1]; j++) {
+        out->shape[1] += (data->type[j] == ARRAY_ONEHOT) ? data->n_values[j] : 1;
+    }
+
+    out->indptr = ecalloc(out->shape[0] + 1, sizeof(size_t));
+    out->indices = ecalloc(out->shape[0] * data->shape[1], sizeof(size_t));
+    out->values = ecalloc(out->shape[0] * data->shape[1], sizeof(nn_float));
+
+    for (nnz = i = 0; i < out->shape[0]; i++) {
+        for (out_j = j = 0; j < data->shape[1]; j++) {
+            double value;
+            switch (data->type[j]) {
+            case ARRAY_NUMERICAL:
+                value = data->columns[j].numeric[i * data->stride];
+                if (value != 0) {
+                    out->indices[nnz] = out_j;
+                    out->values[nnz++] = value;
+                }
+                out_j++;
+                break;
+            case ARRAY_ONEHOT:
+                out->indices[nnz] = out_j + data->columns[j].categorical[i];
+                out->values[nnz++] = 1.0;
+                out_j += data->n_values[j];
+                break;
+            default:
+                die("data_preprocess_sparse() Error: field '%s' has an unknown type", cfgs.input_keys[j]);
+            }
+        }
+        out->indptr[i + 1] = nnz;
+    }
+}
+
+/* True when the onehot encoded data would be at least half zeros */
+bool array_is_sparse(Array x)
+{
+    return array_width(x) >= 2 * x.shape[1];
+}
+
+/* columns of the data_preprocess() output */
+size_t array_width(Array x)
+{
+    size_t width = 0;
+    for (size_t j = 0; j < x.shape[1]; j++) {
+        width += (x.type[j] == ARRAY_ONEHOT) ? x.n_values[j] : 1;
+    }
+    return width;
+}
+
+void sparse_free(Sparse *x)
+{
+    free(x->indptr);
+    free(x->indices);
+    free(x->values);
+}
+
 void array_free(Array *x) {
-    size_t i, j, index;
-    for (j = 1; j < x->shape[1]; j++) {
+    for (size_t j = 0; j < x->shape[1] && !x->row_major; j++) {
         switch (x->type[j]) {
-        case ARRAY_ORDINAL:
-        case ARRAY_ONEHOT:
-            for (i = 0; i < x->shape[0]; i++) {
-                index = x->shape[1] * i + j;
-                free(x->data[index].categorical);
-            }
+        case ARRAY_NUMERICAL:
+            free(x->columns[j].numeric);
             break;
         default:
+            free(x->columns[j].categorical);
             break;
         }
     }
+    free(x->matrix);
     free(x->type);
-    free(x->data);
+    free(x->columns);
+    free(x->values);
+    free(x->n_values);
+}
+
+void array_reserve(Array *x, size_t rows)
+{
+    if (x->row_major) {
+        x->matrix = erealloc(x->matrix, rows * x->shape[1] * sizeof(double));
+        for (size_t j = 0; j < x->shape[1]; j++) {
+            x->columns[j].numeric = x->matrix + j;
+        }
+        x->capacity = rows;
+        return;
+    }
+
+    for (size_t j = 0; j < x->shape[1]; j++) {
+        switch (x->type[j]) {
+        case ARRAY_NUMERICAL:
+            x->columns[j].numeric = erealloc(x->columns[j].numeric, rows * sizeof(double));
+            break;
+        default:
+            x->columns[j].categorical = erealloc(x->columns[j].categorical, rows * sizeof(uint32_t));
+            break;
+        }
+    }
+    x->capacity = rows;
+}
+
+#ifndef NN_FLOAT32
+/* Point the columns of a row_major array to an external matrix with ld values per row */
+void array_view(Array *x, double *matrix, size_t rows, size_t ld)
+{
+    free(x->matrix);
+    x->matrix = NULL;
+    for (size_t j = 0; j < x->shape[1]; j++) {
+        x->columns[j].numeric = matrix + j;
+    }
+    x->shape[0] = x->capacity = rows;
+    x->stride = ld;
+}
+#endif
+
+/*
+ * Mark onehot fields and bind them to their [categorical_fields] values,
+ * arrays without categorical fields are stored directly as a design matrix
+ */
+void array_set_fields(
+        Array *x,
+        char **keys, size_t n_keys,
+        struct Configs cfgs)
+{
+    x->shape[0] = x->capacity = 0;
+    x->shape[1] = n_keys;
+    x->row_major = true;
+    x->matrix = NULL;
+    x->type = ecalloc(n_keys, sizeof(enum ArrayType));
+    x->columns = ecalloc(n_keys, sizeof(union ArrayColumn));
+    x->values = ecalloc(n_keys, sizeof(char **));
+    x->n_values = ecalloc(n_keys, sizeof(size_t));
+
+    for (size_t j = 0; j < n_keys; j++) {
+        int k;
+        if (util_get_key_index(keys[j], cfgs.onehot_keys, cfgs.n_onehot_keys) == -1) continue;
+
+        k = util_get_key_index(keys[j], cfgs.categorical_keys, cfgs.n_categorical_keys);
+        if (k == -1) die("array_set_fields() Error: field '%s' is not registered as categorical", keys[j]);
+
+        x->type[j] = ARRAY_ONEHOT;
+        x->values[j] = cfgs.categorical_values[k];
+        x->n_values[j] = cfgs.n_categorical_values[k];
+        x->row_major = false;
+    }
+    x->stride = (x->row_major) ? n_keys : 1;
 }
 
 void json_read(
@@ -267,28 +495,36 @@ void json_read(
         struct Configs cfgs,
         bool read_output)
 {
-    static char fp_buffer[MAX_FILE_SIZE];
-    size_t i, j, json_obj_length, index;
+    char *fp_buffer;
+    size_t i, j, json_obj_length, buffer_size, length;
     json_object *json_obj, *item, *value;
     json_type obj_type;
 
     char **in_keys = cfgs.input_keys;
     char **out_keys = cfgs.label_keys;
-    char **onehot_keys = cfgs.onehot_keys;
     size_t n_input_keys = cfgs.n_input_keys;
     size_t n_out_keys = cfgs.n_label_keys;
-    size_t n_onehot_keys = cfgs.n_onehot_keys;
+    int code;
 
 
     if (fp == NULL) die("json_read() Error:");
 
-    i = 0;
-    do {
-        if (i >= MAX_FILE_SIZE) die("json_read() Error: file size is bigger than '%zu'", i, MAX_FILE_SIZE);
-        fp_buffer[i] = fgetc(fp);
-    } while (fp_buffer[i++] != EOF);
+    /* buffer of this call, predict -j reads several files at once */
+    buffer_size = BUFSIZ;
+    fp_buffer = erealloc(NULL, buffer_size);
+    length = 0;
+    while ((i = fread(fp_buffer + length, 1, buffer_size - length - 1, fp)) > 0) {
+        length += i;
+        if (length < buffer_size - 1) continue;
+        if (buffer_size >= MAX_FILE_SIZE) die("json_read() Error: file size is bigger than '%d'", MAX_FILE_SIZE);
+        buffer_size *= 2;
+        fp_buffer = erealloc(fp_buffer, buffer_size);
+    }
+    if (ferror(fp)) die("json_read() Error:");
+    fp_buffer[length] = '\0';
 
     json_obj = json_tokener_parse(fp_buffer);
+    free(fp_buffer);
     if (!json_object_is_type(json_obj, json_type_array)) {
         die("json_read() Error: unexpected JSON data received, expecting an array");
     }
@@ -296,29 +532,13 @@ void json_read(
 
 
 
+    array_set_fields(input, in_keys, n_input_keys, cfgs);
+    array_reserve(input, json_obj_length);
     input->shape[0] = (size_t)json_obj_length;
-    input->shape[1] = n_input_keys;
-    input->type = ecalloc(input->shape[1], sizeof(enum ArrayType));
-    input->data = ecalloc(input->shape[0] * input->shape[1], sizeof(input->data[0]));
 
+    array_set_fields(out, out_keys, n_out_keys, cfgs);
+    if (read_output) array_reserve(out, json_obj_length);
     out->shape[0] = (size_t)json_obj_length;
-    out->shape[1] = n_out_keys;
-    out->type = ecalloc(out->shape[1], sizeof(enum ArrayType));
-    out->data = ecalloc(out->shape[0] * out->shape[1], sizeof(out->data[0]));
-
-    for (i = 0; i < n_onehot_keys; i++) {
-        for (j = 0; j < n_input_keys; j++) {
-            if (!strcmp(onehot_keys[i], in_keys[j])) {
-                input->type[j] = ARRAY_ONEHOT;
-            }
-        }
-
-        for (j = 0; j < n_out_keys; j++) {
-            if (!strcmp(onehot_keys[i], out_keys[j])) {
-                out->type[j] = ARRAY_ONEHOT;
-            }
-        }
-    }
 
 
     for (i = 0; i < json_object_array_length(json_obj); i++) {
@@ -336,13 +556,12 @@ void json_read(
         for (j = 0; j < n_input_keys; j++) {
             value = json_object_object_get(item, in_keys[j]);
             obj_type = json_object_get_type(value);
-            index = n_input_keys * i + j;
             switch (input->type[j]) {
             case ARRAY_NUMERICAL:
                 switch (obj_type) {
                 case json_type_int:
                 case json_type_double:
-                    input->data[index].numeric = json_object_get_double(value);
+                    input->columns[j].numeric[i * input->stride] = json_object_get_double(value);
                     break;
                 default:
                     die("json_read() Error: unexpected JSON data received, expecting a number");
@@ -352,7 +571,13 @@ void json_read(
                 switch (obj_type) {
                 case json_type_int:
                 case json_type_string:
-                    input->data[index].categorical = e_strdup(json_object_get_string(value));
+                    code = util_get_value_index(json_object_get_string(value),
+                                                input->values[j], input->n_values[j]);
+                    if (code == -1) {
+                        die("json_read() Error: unexpected '%s' value found on '%s' field",
+                            json_object_get_string(value), in_keys[j]);
+                    }
+                    input->columns[j].categorical[i] = (uint32_t)code;
                     break;
                 default:
                     die("json_read() Error: unexpected JSON data received, expecting a string or integer");
@@ -368,13 +593,12 @@ void json_read(
         for (j = 0; j < n_out_keys; j++) {
             value = json_object_object_get(item, out_keys[j]);
             obj_type = json_object_get_type(value);
-            index = n_out_keys * i + j;
             switch (out->type[j]) {
             case ARRAY_NUMERICAL:
                 switch (obj_type) {
                 case json_type_int:
                 case json_type_double:
-                    out->data[index].numeric = json_object_get_double(value);
+                    out->columns[j].numeric[i * out->stride] = json_object_get_double(value);
                     break;
                 default:
                     die("json_read() Error: unexpected JSON data received, expecting a number");
@@ -384,7 +608,13 @@ void json_read(
                 switch (obj_type) {
                 case json_type_int:
                 case json_type_string:
-                    out->data[index].categorical = e_strdup(json_object_get_string(value));
+                    code = util_get_value_index(json_object_get_string(value),
+                                                out->values[j], out->n_values[j]);
+                    if (code == -1) {
+                        die("json_read() Error: unexpected '%s' value found on '%s' field",
+                            json_object_get_string(value), out_keys[j]);
+                    }
+                    out->columns[j].categorical[i] = (uint32_t)code;
                     break;
                 default:
                     die("json_read() Error: unexpected JSON data received, expecting string or integer");
@@ -409,117 +639,171 @@ void csv_read(
         bool read_output,
         char *separator)
 {
-    char *line = NULL, *line_buffer, **values_buffer;
-    size_t line_number = 0, line_size = 0;
-    size_t n_values_buffer;
-    size_t *in_indexes, *out_indexes;
-    bool has_header = true;
+    CsvStream stream = {.fp = fp, .separator = separator, .read_output = read_output};
 
-    char **in_keys, **out_keys, **onehot_keys;
-    size_t n_in_keys, n_out_keys, n_onehot_keys;
+    if (fp == NULL) die("csv_read() Error:");
 
-    in_keys = cfgs.input_keys;
-    out_keys = cfgs.label_keys;
-    onehot_keys = cfgs.onehot_keys;
+    csv_stream_init(&stream, input, out, cfgs);
+    csv_stream_read(&stream, input, out, cfgs, SIZE_MAX);
+    stream.fp = NULL;
+    csv_stream_close(&stream);
+}
 
-    n_in_keys = cfgs.n_input_keys;
-    n_out_keys = cfgs.n_label_keys;
-    n_onehot_keys = cfgs.n_onehot_keys;
+/* Open a csv or tsv file to be read by chunks of rows */
+void csv_stream_open(
+        CsvStream *stream,
+        char *filepath,
+        Array *input, Array *out,
+        struct Configs cfgs,
+        bool read_output)
+{
+    char *file_format = (strcmp(filepath, "-")) ? file_format_infer(filepath) : cfgs.file_format;
 
-    n_values_buffer = n_in_keys + n_out_keys;
-    values_buffer = ecalloc(n_values_buffer, sizeof(char *));
+    if (file_format == NULL) die("csv_stream_open() Error: file format must be defined");
+    if (!strcmp(file_format, "csv"))        stream->separator = ",";
+    else if (!strcmp(file_format, "tsv"))   stream->separator = "\t";
+    else die("csv_stream_open() Error: only csv and tsv files can be read by chunks not %s", file_format);
 
-    in_indexes = ecalloc(n_in_keys, sizeof(size_t));
-    out_indexes = ecalloc(n_out_keys, sizeof(size_t));
+    stream->fp = (strcmp(filepath, "-")) ? fopen(filepath, "r") : fopen("/dev/stdin", "r");
+    if (stream->fp == NULL) die("csv_stream_open() Error:");
+    stream->read_output = read_output;
+    csv_stream_init(stream, input, out, cfgs);
+}
 
-    if (fp == NULL) die("csv_read() Error:");
+void csv_stream_init(CsvStream *stream, Array *input, Array *out, struct Configs cfgs)
+{
+    stream->n_values = cfgs.n_input_keys + cfgs.n_label_keys;
+    stream->values = ecalloc(stream->n_values, sizeof(char *));
+    stream->in_indexes = ecalloc(cfgs.n_input_keys, sizeof(size_t));
+    stream->out_indexes = ecalloc(cfgs.n_label_keys, sizeof(size_t));
+    stream->has_header = true;
+    stream->line_number = 0;
+    stream->line = NULL;
+    stream->line_size = 0;
+
+    array_set_fields(input, cfgs.input_keys, cfgs.n_input_keys, cfgs);
+    array_set_fields(out, cfgs.label_keys, cfgs.n_label_keys, cfgs);
+}
 
-    input->type = ecalloc(n_in_keys, sizeof(enum ArrayType));
-    out->type = ecalloc(n_out_keys, sizeof(enum ArrayType));
-    input->data = NULL;
-    out->data = NULL;
+void csv_stream_close(CsvStream *stream)
+{
+    if (stream->fp) fclose(stream->fp);
+    free(stream->line);
+    free(stream->in_indexes);
+    free(stream->out_indexes);
+    free(stream->values);
+}
 
-    input->shape[0] = out->shape[0] = 0;
-    input->shape[1] = n_in_keys;
-    out->shape[1] = n_out_keys;
+/*
+ * Replace the rows of input and out with the next max_rows rows of the file,
+ * returns the rows read. Zeroed arrays get their fields on the first call.
+ */
+size_t csv_stream_read(
+        CsvStream *stream,
+        Array *input,
+        Array *out,
+        struct Configs cfgs,
+        size_t max_rows)
+{
+    char *line_buffer;
+    size_t *in_indexes = stream->in_indexes, *out_indexes = stream->out_indexes;
+    bool read_output = stream->read_output;
+    char *separator = stream->separator;
 
-    for (size_t i = 0; i < n_in_keys; i++) {
-        int ret = util_get_key_index(in_keys[i], onehot_keys, n_onehot_keys);
-        if (ret >= 0) input->type[i] = ARRAY_ONEHOT;
-    }
+    char **in_keys, **out_keys;
+    size_t n_in_keys, n_out_keys;
 
-    for (size_t i = 0; i < n_out_keys; i++) {
-        int ret = util_get_key_index(out_keys[i], onehot_keys, n_onehot_keys);
-        if (ret >= 0) out->type[i] = ARRAY_ONEHOT;
-    }
+    in_keys = cfgs.input_keys;
+    out_keys = cfgs.label_keys;
 
-    while (getline(&line, &line_size, fp) != -1) {
+    n_in_keys = cfgs.n_input_keys;
+    n_out_keys = cfgs.n_label_keys;
+
+    if (!input->type) array_set_fields(input, in_keys, n_in_keys, cfgs);
+    if (!out->type) array_set_fields(out, out_keys, n_out_keys, cfgs);
+
+    // data_preprocess() may have taken the matrices of the previous chunk
+    if (input->row_major && !input->matrix) input->capacity = 0;
+    if (out->row_major && !out->matrix) out->capacity = 0;
+    input->shape[0] = out->shape[0] = 0;
+
+    while (input->shape[0] < max_rows && getline(&stream->line, &stream->line_size, stream->fp) != -1) {
         /* Get line values */
-        char *value;
-        size_t cols = 0;
+        char *value, *line = stream->line, **values_buffer;
+        size_t cols = 0, line_number = stream->line_number;
         line_buffer = line;
         *(strstr(line, "\n")) = '\0'; //strip new line character e.g ("line text\n" -> "line text")
         while ((value = strsep(&line_buffer, separator))) {
-            if (cols == n_values_buffer && line_number == 0) {
-                n_values_buffer++;
-                values_buffer = erealloc(values_buffer, n_values_buffer * sizeof(char *));
-            } else if (cols == n_values_buffer) {
+            if (cols == stream->n_values && line_number == 0) {
+                stream->n_values++;
+                stream->values = erealloc(stream->values, stream->n_values * sizeof(char *));
+            } else if (cols == stream->n_values) {
                 die("csv_read() Error: line %d has different columns than other lines", line_number);
             }
-            values_buffer[cols++] = value;
+            stream->values[cols++] = value;
         }
+        values_buffer = stream->values;
 
         /* Set up keys indexes */
         if (line_number == 0) {
             size_t i;
             int key_index;
+            bool has_header = true;
 
             for (i = 0; i < n_in_keys && has_header; i++) {
-                key_index = util_get_key_index(in_keys[i], values_buffer, n_values_buffer);
+                key_index = util_get_key_index(in_keys[i], values_buffer, stream->n_values);
                 if (key_index == -1) has_header = false;
             }
 
             for (i = 0; i < n_out_keys && read_output && has_header; i++) {
-                key_index = util_get_key_index(out_keys[i], values_buffer, n_values_buffer);
+                key_index = util_get_key_index(out_keys[i], values_buffer, stream->n_values);
                 if (key_index == -1) has_header = false;
             }
 
             for (i = 0; i < n_in_keys; i++) {
-                key_index = util_get_key_index(in_keys[i], values_buffer, n_values_buffer);
+                key_index = util_get_key_index(in_keys[i], values_buffer, stream->n_values);
                 in_indexes[i] = has_header ? (size_t)key_index : i;
             }
 
             for (i = 0; i < n_out_keys && read_output; i++) {
-                key_index = util_get_key_index(out_keys[i], values_buffer, n_values_buffer);
+                key_index = util_get_key_index(out_keys[i], values_buffer, stream->n_values);
                 out_indexes[i] = has_header ? (size_t)key_index : i + n_in_keys;
             }
+            stream->has_header = has_header;
         }
 
-        if (has_header && !line_number) {
-            line_number++;
-            continue;
-        }
+        stream->line_number++;
+        if (stream->has_header && !line_number) continue;
 
         /* Allocate memory for the data */
-        input->data = erealloc(input->data, (input->shape[0] + 1) * n_in_keys * sizeof(union ArrayValue));
-        out->data = erealloc(out->data, (out->shape[0] + 1) * n_out_keys * sizeof(union ArrayValue));
+        if (input->shape[0] == input->capacity) {
+            size_t rows = (input->capacity) ? 2 * input->capacity : 1024;
+            if (rows > max_rows) rows = max_rows;
+            array_reserve(input, rows);
+            if (read_output) array_reserve(out, rows);
+        }
 
         /* Fill the data */
         int ret;
-        size_t i, j, index;
+        size_t i, j, row = input->shape[0];
+        double number;
         for (i = 0; i < n_in_keys; i++) {
             ret = 0;
             j = in_indexes[i];
-            index = input->shape[0] * n_in_keys + i;
             switch (input->type[i]) {
             case ARRAY_NUMERICAL:
-                ret = sscanf(values_buffer[j], "%lf", &input->data[index].numeric);
+                ret = sscanf(values_buffer[j], "%lf", &input->columns[i].numeric[row * input->stride]);
                 if (ret < 1) die("csv_read() Error: expecting a number not '%s'", values_buffer[j]);
                 break;
             case ARRAY_ONEHOT:
-                ret = sscanf(values_buffer[j], "%lf", &input->data[index].numeric);
+                ret = sscanf(values_buffer[j], "%lf", &number);
                 if (ret >= 1) die("csv_read() Error: expecting a string or integer not '%s'", values_buffer[j]);
-                input->data[index].categorical = e_strdup(values_buffer[j]);
+                ret = util_get_value_index(values_buffer[j], input->values[i], input->n_values[i]);
+                if (ret == -1) {
+                    die("csv_read() Error: unexpected '%s' value found on '%s' field",
+                        values_buffer[j], in_keys[i]);
+                }
+                input->columns[i].categorical[row] = (uint32_t)ret;
                 break;
             default:
                 die("csv_read() Error: field '%s' has an unexpected type", in_keys[i]);
@@ -529,14 +813,18 @@ void csv_read(
         for (i = 0; i < n_out_keys && read_output; i++) {
             ret = 0;
             j = out_indexes[i];
-            index = out->shape[0] * n_out_keys + i;
             switch (out->type[i]) {
             case ARRAY_NUMERICAL:
-                ret = sscanf(values_buffer[j], "%lf", &out->data[index].numeric);
+                ret = sscanf(values_buffer[j], "%lf", &out->columns[i].numeric[row * out->stride]);
                 if (ret < 1) die("csv_read() Error: expecting a number not '%s'", values_buffer[j]);
                 break;
             case ARRAY_ONEHOT:
-                out->data[index].categorical = e_strdup(values_buffer[j]);
+                ret = util_get_value_index(values_buffer[j], out->values[i], out->n_values[i]);
+                if (ret == -1) {
+                    die("csv_read() Error: unexpected '%s' value found on '%s' field",
+                        values_buffer[j], out_keys[i]);
+                }
+                out->columns[i].categorical[row] = (uint32_t)ret;
                 break;
             default:
                 die("csv_read() Error: field '%s' has an unexpected type", out_keys[i]);
@@ -544,139 +832,446 @@ void csv_read(
         }
         input->shape[0]++;
         out->shape[0]++;
-        line_number++;
     }
 
     if (errno != 0) die("csv_read() Error:");
+    return input->shape[0];
+}
+
+/*
+ * LIBSVM/SVMlight lines: "label[,label...] index:value index:value ... # comment"
+ * indexes start at 1, qid tokens are ignored
+ */
+void libsvm_read(
+        FILE *fp,
+        Sparse *input, Array *out,
+        struct Configs cfgs,
+        bool read_output)
+{
+    char *line = NULL, *token, *line_buffer, *end;
+    size_t line_size = 0, line_number = 0, capacity = 1024, nnz_capacity = 1024, nnz = 0;
+    size_t max_index = 0;
+    char **out_keys = cfgs.label_keys;
+    size_t n_out_keys = cfgs.n_label_keys;
+
+    if (fp == NULL) die("libsvm_read() Error:");
+
+    array_set_fields(out, out_keys, n_out_keys, cfgs);
+    if (read_output) array_reserve(out, capacity);
+
+    input->indptr = ecalloc(capacity + 1, sizeof(size_t));
+    input->indices = ecalloc(nnz_capacity, sizeof(size_t));
+    input->values = ecalloc(nnz_capacity, sizeof(nn_float));
+    input->shape[0] = 0;
+
+    while (getline(&line, &line_size, fp) != -1) {
+        size_t row = input->shape[0];
+        line_number++;
+
+        if ((end = strchr(line, '#'))) *end = '\0';
+        line_buffer = line + strspn(line, " \t");
+        if (*line_buffer == '\0' || *line_buffer == '\n') continue; // blank line
+
+        // unlabeled rows start directly with features
+        token = NULL;
+        if (!memchr(line_buffer, ':', strcspn(line_buffer, " \t\n"))) token = strsep(&line_buffer, " \t\n");
+        else if (read_output) die("libsvm_read() Error: line %zu has no labels", line_number);
 
+        if (row == capacity) {
+            capacity *= 2;
+            input->indptr = erealloc(input->indptr, (capacity + 1) * sizeof(size_t));
+            if (read_output) array_reserve(out, capacity);
+        }
+
+        /* Labels */
+        for (size_t j = 0; j < n_out_keys && read_output; j++) {
+            char *label = strsep(&token, ",");
+            int code;
+            if (label == NULL) die("libsvm_read() Error: line %zu has less labels than expected", line_number);
+            switch (out->type[j]) {
+            case ARRAY_NUMERICAL:
+                out->columns[j].numeric[row * out->stride] = strtod(label, &end);
+                if (end == label || *end) die("libsvm_read() Error: expecting a number not '%s'", label);
+                break;
+            case ARRAY_ONEHOT:
+                code = util_get_value_index(label, out->values[j], out->n_values[j]);
+                if (code == -1) {
+                    die("libsvm_read() Error: unexpected '%s' value found on '%s' field", label, out_keys[j]);
+                }
+                out->columns[j].categorical[row] = (uint32_t)code;
+                break;
+            default:
+                die("libsvm_read() Error: field '%s' has an unexpected type", out_keys[j]);
+            }
+        }
+
+        /* Features */
+        while ((token = strsep(&line_buffer, " \t\n"))) {
+            char *value;
+            unsigned long index;
+
+            if (*token == '\0' || !strncmp(token, "qid:", 4)) continue;
+
+            index = strtoul(token, &value, 10);
+            if (value == token || *value != ':' || index == 0) {
+                die("libsvm_read() Error: unexpected '%s' feature on line %zu", token, line_number);
+            }
+
+            if (nnz == nnz_capacity) {
+                nnz_capacity *= 2;
+                input->indices = erealloc(input->indices, nnz_capacity * sizeof(size_t));
+                input->values = erealloc(input->values, nnz_capacity * sizeof(nn_float));
+            }
+            input->indices[nnz] = index - 1;
+            input->values[nnz] = strtod(value + 1, &end);
+            if (end == value + 1 || *end) die("libsvm_read() Error: expecting a number not '%s'", value + 1);
+            if (index > max_index) max_index = index;
+            nnz++;
+        }
+        input->indptr[row + 1] = nnz;
+        input->shape[0]++;
+    }
+
+    if (errno != 0) die("libsvm_read() Error:");
+
+    if (cfgs.n_features && max_index > cfgs.n_features) {
+        die("libsvm_read() Error: feature %zu found but there are only %zu features",
+            max_index, cfgs.n_features);
+    }
+    input->shape[1] = (cfgs.n_features) ? cfgs.n_features : max_index;
+    out->shape[0] = input->shape[0];
     free(line);
-    free(in_indexes);
-    free(out_indexes);
-    free(values_buffer);
 }
 
 void json_write(
-        FILE *fp,
+        FileWriter *writer,
         Array input, Array out,
-        struct Configs cfgs)
+        struct Configs cfgs,
+        enum JsonStyle style)
 {
     char **in_keys = cfgs.input_keys;
     char **out_keys = cfgs.label_keys;
     size_t n_in_keys = cfgs.n_input_keys;
     size_t n_out_keys = cfgs.n_label_keys;
-    bool write_input = !cfgs.only_out;
+    bool write_input = !cfgs.only_out && input.shape[1] > 0;
     int decimal_precision = cfgs.decimal_precision;
 
-    json_object *root = json_object_new_array();
-    if (!root) {
-        die("json_write() Error: Unable to create json_data");
-    }
-
-    if (n_in_keys != input.shape[1])
+    if (write_input && n_in_keys != input.shape[1])
         die("json_write() Error: input keys and data columns have different sizes");
     if (n_out_keys != out.shape[1])
         die("json_write() Error: output keys and data columns have different sizes");
 
-    size_t i, j;
-    for (i = 0; i < input.shape[0]; i++) {
-        json_object *obj = json_object_new_object();
-
-        if (write_input) {
-            for (j = 0; j < input.shape[1]; j++) {
-                char buffer[128];
-                size_t index = i * input.shape[1] + j;
-                switch (input.type[j]) {
-                case ARRAY_NUMERICAL:
-                    sprintf(buffer, "%g", input.data[index].numeric);
-                    json_object_object_add(obj, in_keys[j], json_object_new_double_s(input.data[index].numeric, buffer));
-                    break;
-                case ARRAY_ONEHOT:
-                    json_object_object_add(obj, in_keys[j], json_object_new_string(input.data[index].categorical));
-                    break;
-                default:
-                    die("json_write(): Unexpected value received");
-                }
+    const char *array_open = JSON_TOKENS[style].array_open;
+    const char *object_open = JSON_TOKENS[style].object_open;
+    const char *object_close = JSON_TOKENS[style].object_close;
+    const char *object_sep = JSON_TOKENS[style].object_sep;
+    const char *field_sep = JSON_TOKENS[style].field_sep;
+    const char *key_sep = JSON_TOKENS[style].key_sep;
+
+    struct Buffer buffer = {.fp = writer->fp, .data = ecalloc(BUFFER_SIZE, 1), .capacity = BUFFER_SIZE};
+    size_t object_open_len = strlen(object_open);
+    size_t object_close_len = strlen(object_close);
+    size_t object_sep_len = strlen(object_sep);
+    size_t field_sep_len = strlen(field_sep);
+
+    /* Escape the keys only once, they are written on every object */
+    size_t i, j, n_keys = n_in_keys + n_out_keys;
+    char **keys = ecalloc(n_keys, sizeof(char *));
+    size_t *keys_offset = ecalloc(n_keys + 1, sizeof(size_t));
+    struct Buffer keys_buffer = {.fp = NULL};
+
+    for (j = 0; j < n_keys; j++) {
+        keys[j] = (j < n_in_keys) ? in_keys[j] : out_keys[j - n_in_keys];
+        keys_buffer.capacity += 6 * strlen(keys[j]) + 4;
+    }
+    keys_buffer.data = ecalloc(keys_buffer.capacity, 1);
+    for (j = 0; j < n_keys; j++) {
+        buffer_json_string(&keys_buffer, keys[j]);
+        buffer_write(&keys_buffer, key_sep, strlen(key_sep));
+        keys_offset[j + 1] = keys_buffer.size;
+    }
+#define KEY(j) keys_buffer.data + keys_offset[j], keys_offset[(j) + 1] - keys_offset[j]
+
+    if (!writer->started) buffer_write(&buffer, array_open, strlen(array_open));
+    writer->started = true;
+    for (i = 0; i < out.shape[0]; i++) {
+        bool first_field = true;
+
+        if (writer->rows + i) buffer_write(&buffer, object_sep, object_sep_len);
+        buffer_write(&buffer, object_open, object_open_len);
+
+        for (j = 0; j < input.shape[1] && write_input; j++) {
+            if (!first_field) buffer_write(&buffer, field_sep, field_sep_len);
+            buffer_write(&buffer, KEY(j));
+            first_field = false;
+            switch (input.type[j]) {
+            case ARRAY_NUMERICAL:
+                buffer_json_double(&buffer, input.columns[j].numeric[i * input.stride], -1);
+                break;
+            case ARRAY_ONEHOT:
+                buffer_json_string(&buffer, input.values[j][input.columns[j].categorical[i]]);
+                break;
+            default:
+                die("json_write(): Unexpected value received");
             }
         }
 
-
         for (j = 0; j < out.shape[1]; j++) {
-            size_t index = i * out.shape[1] + j;
-            char buffer[32];
+            if (!first_field) buffer_write(&buffer, field_sep, field_sep_len);
+            buffer_write(&buffer, KEY(n_in_keys + j));
+            first_field = false;
             switch (out.type[j]) {
             case ARRAY_NUMERICAL:
-                sprintf(buffer, "%.*g", decimal_precision, out.data[index].numeric);
-                json_object_object_add(obj, out_keys[j], json_object_new_double_s(out.data[index].numeric, buffer));
+                buffer_json_double(&buffer, out.columns[j].numeric[i * out.stride], decimal_precision);
                 break;
             case ARRAY_ONEHOT:
-                json_object_object_add(obj, out_keys[j], json_object_new_string(out.data[index].categorical));
+                buffer_json_string(&buffer, out.values[j][out.columns[j].categorical[i]]);
                 break;
             default:
                 die("json_write(): Unexpected value received");
             }
         }
-        json_object_array_add(root, obj);
+        buffer_write(&buffer, object_close, object_close_len);
     }
-    int ret = fprintf(fp, "%s", json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_SPACED));
-    if (ret == -1) {
-        die("json_write() Error: unable to write json data");
-    }
-    json_object_put(root);
+    writer->rows += out.shape[0];
+    buffer_flush(&buffer);
+
+#undef KEY
+    free(keys);
+    free(keys_offset);
+    free(keys_buffer.data);
+    free(buffer.data);
 }
 
 void csv_write(
-        FILE *fp,
+        FileWriter *writer,
         Array input, Array out,
         struct Configs cfgs,
         char *separator)
 {
-    int decimal_precision = cfgs.decimal_precision;
-    bool write_input = !cfgs.only_out;
+    // auto keeps printf's 6 significant digits, the shortest round trip is 2.5 times bigger
+    int decimal_precision = (cfgs.decimal_precision < 0) ? 6 : cfgs.decimal_precision;
+    bool write_input = !cfgs.only_out && input.shape[1] > 0;
+    size_t separator_len = strlen(separator);
+    char number[32], *value;
 
-    size_t i,j,index;
+    struct Buffer buffer = {.fp = writer->fp, .data = ecalloc(BUFFER_SIZE, 1), .capacity = BUFFER_SIZE};
+    size_t i,j;
 
-    for (j = 0; j < cfgs.n_input_keys && write_input; j++) {
-        fprintf(fp, "%s%s", cfgs.input_keys[j], separator);
-    }
-
-    for (j = 0; j < cfgs.n_label_keys; j++) {
-        fprintf(fp, "%s", cfgs.label_keys[j]);
+    if (!writer->started) csv_write_header(&buffer, cfgs, write_input, separator);
+    writer->started = true;
 
-        if (j == cfgs.n_label_keys - 1) fprintf(fp, "\n");
-        else fprintf(fp, "%s", separator);
-    }
-
-    for (i = 0; i < input.shape[0]; i++) {
+    for (i = 0; i < out.shape[0]; i++) {
         for (j = 0; j < input.shape[1] && write_input; j++) {
-            index = i * out.shape[1] + j;
             switch (input.type[j] ) {
             case ARRAY_NUMERICAL:
-                fprintf(fp, "%.*g%s", decimal_precision, input.data[index].numeric, separator);
+                buffer_write(&buffer, number,
+                             format_double(number, input.columns[j].numeric[i * input.stride], decimal_precision));
                 break;
             case ARRAY_ONEHOT:
-                fprintf(fp, "%s%s", input.data[index].categorical, separator);
+                value = input.values[j][input.columns[j].categorical[i]];
+                buffer_write(&buffer, value, strlen(value));
                 break;
             default:
                 die("csv_write() Error: Unexpected type found on field '%s'", cfgs.input_keys[j]);
             }
+            buffer_write(&buffer, separator, separator_len);
         }
 
         for (j = 0; j < out.shape[1]; j++) {
-            index = i * out.shape[1] + j;
             switch (out.type[j] ) {
             case ARRAY_NUMERICAL:
-                fprintf(fp, "%.*g", decimal_precision, out.data[index].numeric);
+                buffer_write(&buffer, number,
+                             format_double(number, out.columns[j].numeric[i * out.stride], decimal_precision));
                 break;
             case ARRAY_ONEHOT:
-                fprintf(fp, "%s", out.data[index].categorical);
+                value = out.values[j][out.columns[j].categorical[i]];
+                buffer_write(&buffer, value, strlen(value));
                 break;
             default:
                 die("csv_write() Error: Unexpected type found on field '%s'", cfgs.label_keys[j]);
             }
-            if (j == out.shape[1] - 1) fprintf(fp, "\n");
-            else fprintf(fp, "%s", separator);
+            if (j == out.shape[1] - 1) buffer_write(&buffer, "\n", 1);
+            else buffer_write(&buffer, separator, separator_len);
+        }
+    }
+    writer->rows += out.shape[0];
+    buffer_flush(&buffer);
+    free(buffer.data);
+}
+
+void csv_write_header(struct Buffer *buffer, struct Configs cfgs, bool write_input, char *separator)
+{
+    size_t j, separator_len = strlen(separator);
+
+    for (j = 0; j < cfgs.n_input_keys && write_input; j++) {
+        buffer_write(buffer, cfgs.input_keys[j], strlen(cfgs.input_keys[j]));
+        buffer_write(buffer, separator, separator_len);
+    }
+
+    for (j = 0; j < cfgs.n_label_keys; j++) {
+        buffer_write(buffer, cfgs.label_keys[j], strlen(cfgs.label_keys[j]));
+
+        if (j == cfgs.n_label_keys - 1) buffer_write(buffer, "\n", 1);
+        else buffer_write(buffer, separator, separator_len);
+    }
+}
+
+void buffer_flush(struct Buffer *buffer)
+{
+    if (fwrite(buffer->data, 1, buffer->size, buffer->fp) != buffer->size) {
+        die("buffer_flush() Error:");
+    }
+    buffer->size = 0;
+}
+
+void buffer_write(struct Buffer *buffer, const char *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity) buffer_flush(buffer);
+    if (size > buffer->capacity) {
+        if (fwrite(data, 1, size, buffer->fp) != size) die("buffer_write() Error:");
+        return;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+void buffer_json_string(struct Buffer *buffer, const char *string)
+{
+    char escaped[8];
+    const char *ptr, *start;
+
+    buffer_write(buffer, "\"", 1);
+    for (start = ptr = string; *ptr; ptr++) {
+        unsigned char c = *ptr;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        buffer_write(buffer, start, ptr - start);
+        switch (c) {
+        case '"':   buffer_write(buffer, "\\\"", 2); break;
+        case '\\':  buffer_write(buffer, "\\\\", 2); break;
+        case '\n':  buffer_write(buffer, "\\n", 2); break;
+        case '\t':  buffer_write(buffer, "\\t", 2); break;
+        case '\r':  buffer_write(buffer, "\\r", 2); break;
+        default:
+            sprintf(escaped, "\\u%04x", c);
+            buffer_write(buffer, escaped, 6);
         }
+        start = ptr + 1;
     }
+    buffer_write(buffer, start, ptr - start);
+    buffer_write(buffer, "\"", 1);
+}
+
+void buffer_json_double(struct Buffer *buffer, double value, int precision)
+{
+    char number[32];
+
+    if (isnan(value))       buffer_write(buffer, "NaN", 3);
+    else if (isinf(value))  buffer_write(buffer, (value > 0) ? "Infinity" : "-Infinity", (value > 0) ? 8 : 9);
+    else                    buffer_write(buffer, number, format_double(number, value, precision));
+}
+
+/*
+ * Lay out the n significant digits of d.ddd * 10^exponent as printf("%.*g")
+ * does, exponent notation is used below 1e-4 and from 10^precision on.
+ */
+int format_digits(char *out, bool negative, const char *digits, int n, int exponent, int precision)
+{
+    int i, size = 0;
+
+    if (negative) out[size++] = '-';
+    if (exponent < -4 || exponent >= precision) {
+        out[size++] = digits[0];
+        if (n > 1) {
+            out[size++] = '.';
+            memcpy(out + size, digits + 1, n - 1);
+            size += n - 1;
+        }
+        out[size++] = 'e';
+        out[size++] = (exponent < 0) ? '-' : '+';
+        exponent = abs(exponent);
+        if (exponent >= 100) out[size++] = '0' + exponent / 100;
+        out[size++] = '0' + exponent / 10 % 10;
+        out[size++] = '0' + exponent % 10;
+    } else if (exponent >= 0) {
+        for (i = 0; i <= exponent; i++) out[size++] = (i < n) ? digits[i] : '0';
+        if (n > exponent + 1) {
+            out[size++] = '.';
+            memcpy(out + size, digits + exponent + 1, n - exponent - 1);
+            size += n - exponent - 1;
+        }
+    } else {
+        out[size++] = '0';
+        out[size++] = '.';
+        for (i = -1; i > exponent; i--) out[size++] = '0';
+        memcpy(out + size, digits, n);
+        size += n;
+    }
+    out[size] = '\0';
+    return size;
+}
+
+/*
+ * printf("%.*g") for precisions up to 15 digits, the significant digits
+ * are computed with a single scaling by a power of ten (exact up to
+ * 1e22) so printf is only needed for extreme exponents and rounding ties.
+ */
+int format_general(char *out, double value, int precision)
+{
+    char digits[16];
+    double magnitude = fabs(value), scaled;
+    int64_t mantissa;
+    int exponent, shift, n, i;
+
+    if (precision == 0) precision = 1;
+    if (precision > 15 || value == 0 || !isfinite(value)) goto format_general_printf;
+
+    exponent = (int)floor(log10(magnitude));
+    for (i = 0; i < 2; i++) {
+        shift = precision - 1 - exponent;
+        if (shift < -22 || shift > 22) goto format_general_printf;
+        scaled = (shift >= 0) ? magnitude * POW10[shift] : magnitude / POW10[-shift];
+        if (scaled >= POW10[precision]) exponent++;
+        else if (scaled < POW10[precision - 1]) exponent--;
+        else break;
+    }
+    if (i == 2) goto format_general_printf;
+
+    /* product is rounded once, leave the ties for printf */
+    if (fabs(scaled - floor(scaled) - 0.5) <= scaled * 2.3e-16) goto format_general_printf;
+
+    mantissa = (int64_t)nearbyint(scaled);
+    if (mantissa == (int64_t)POW10[precision]) {
+        mantissa /= 10;
+        exponent++;
+    }
+
+    for (i = precision - 1; i >= 0; i--, mantissa /= 10) digits[i] = '0' + mantissa % 10;
+    for (n = precision; n > 1 && digits[n - 1] == '0'; n--);
+    return format_digits(out, signbit(value), digits, n, exponent, precision);
+
+format_general_printf:
+    return sprintf(out, "%.*g", precision, value);
+}
+
+/*
+ * Write value as printf("%.*g") does, a negative precision writes the
+ * shortest representation that reads back to the same double, laid out
+ * as printf would with at least 15 digits.
+ * out must have room for 32 characters.
+ */
+int format_double(char *out, double value, int precision)
+{
+    char digits[17];
+    int n, exponent;
+
+    if (precision > 17) precision = 17; // further digits are not significant on a double
+    if (precision >= 0) return format_general(out, value, precision);
+    if (value == 0 || !isfinite(value)) return sprintf(out, "%g", value);
+
+    n = dtoa_shortest(value, digits, &exponent);
+    return format_digits(out, signbit(value), digits, n, exponent, (n > 15) ? n : 15);
 }
 
 char * file_format_infer(char *filename)
@@ -693,3 +1288,123 @@ char * file_format_infer(char *filename)
     file_format = ptr + 1;
     return file_format;
 }
+
+#ifdef PARSE_TEST
+/*
+ * compile: clang -Wall -Wextra -g -DPARSE_TEST -o objs/test_parse src/util.c src/parse.c src/dtoa.c src/tensor.c $(pkg-config --libs-only-l json-c) -lm -lpthread
+ */
+#include <pthread.h>
+
+struct JsonJob {
+    FILE *fp;
+    size_t rows;
+    bool ok;
+};
+
+static void *json_job(void *arg)
+{
+    struct JsonJob *job = arg;
+    char *in_keys[] = {"x"}, *out_keys[] = {"y"};
+    struct Configs cfg = {.input_keys = in_keys, .n_input_keys = 1, .label_keys = out_keys, .n_label_keys = 1};
+
+    job->ok = true;
+    for (int t = 0; t < 50; t++) {
+        Array in, out;
+        rewind(job->fp);
+        json_read(job->fp, &in, &out, cfg, true);
+        if (in.shape[0] != job->rows || in.matrix[job->rows - 1] != (double)job->rows - 1) job->ok = false;
+        array_free(&in);
+        array_free(&out);
+    }
+    return NULL;
+}
+
+int main(void) {
+    /*
+     * json_read() on several threads test, as predict -j does
+     */
+    struct JsonJob jobs[4];
+    pthread_t threads[4];
+
+    for (size_t t = 0; t < 4; t++) {
+        jobs[t].fp = tmpfile();
+        jobs[t].rows = 10 + t * 1500;
+        fputc('[', jobs[t].fp);
+        for (size_t r = 0; r < jobs[t].rows; r++)
+            fprintf(jobs[t].fp, "%s{\"x\": %zu, \"y\": 1}", (r) ? ", " : "", r);
+        fputc(']', jobs[t].fp);
+        pthread_create(&threads[t], NULL, json_job, &jobs[t]);
+    }
+    for (size_t t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        fclose(jobs[t].fp);
+        if (!jobs[t].ok) {
+            printf("- json_read() failure: a file of %zu rows was read wrong next to other threads\n", jobs[t].rows);
+            return 1;
+        }
+    }
+    printf("- json_read() success\n");
+
+
+    /*
+     * format_double() test
+     */
+    double values[] = {
+        0, -0.0, 1, -1, 0.5, 0.125, 2.5, 1e-5, 123456789, 0.1, 1.0 / 3,
+        9.9999999, 99.95, 1e22, 1e-300, 6.02214076e23, -4.9e-324, 1e15, 0.00012345
+    };
+    char out[32], expected[32];
+    size_t i;
+    int precision;
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        for (precision = 0; precision <= 17; precision++) {
+            sprintf(expected, "%.*g", precision, values[i]);
+            format_double(out, values[i], precision);
+            if (strcmp(out, expected)) {
+                printf("- format_double() failure: '%s' instead of '%s'\n", out, expected);
+                return 1;
+            }
+        }
+
+        format_double(out, values[i], -1);
+        if (strtod(out, NULL) != values[i] || signbit(strtod(out, NULL)) != signbit(values[i])) {
+            printf("- format_double() failure: '%s' does not round trip\n", out);
+            return 1;
+        }
+    }
+
+    /* auto precision over random doubles: round trip with no more digits than printf needs */
+    srandom(1);
+    for (i = 0; i < 100000; i++) {
+        uint64_t bits = (uint64_t)random() << 62 ^ (uint64_t)random() << 31 ^ (uint64_t)random();
+        double value;
+        char *ptr;
+        int n = 0, zeros = 0;
+
+        memcpy(&value, &bits, sizeof(value));
+        if (!isfinite(value) || value == 0) continue;
+        format_double(out, value, -1);
+        if (strtod(out, NULL) != value) {
+            printf("- format_double() failure: '%s' does not round trip %a\n", out, value);
+            return 1;
+        }
+        for (precision = 1; precision < 17; precision++) {
+            sprintf(expected, "%.*g", precision, value);
+            if (strtod(expected, NULL) == value) break;
+        }
+        for (ptr = out; *ptr && *ptr != 'e'; ptr++) {
+            if (*ptr < '0' || *ptr > '9' || (*ptr == '0' && n == 0)) continue;
+            zeros = (*ptr == '0') ? zeros + 1 : 0;
+            n++;
+        }
+        if (n - zeros > precision) {
+            printf("- format_double() failure: '%s' is longer than '%s'\n", out, expected);
+            return 1;
+        }
+    }
+    printf("- format_double() success\n");
+
+    return 0;
+}
+#endif //PARSE_TEST
@@ -2,9 +2,11 @@
 #define PARSE_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #include "util.h"
+#include "nn.h"
 
 enum ArrayType {
     ARRAY_NUMERICAL,
@@ -12,32 +14,76 @@ enum ArrayType {
     ARRAY_ONEHOT
 };
 
-union ArrayValue {
-    double numeric;
-    char *categorical;
+union ArrayColumn {
+    double *numeric;
+    uint32_t *categorical; /* indexes on the field [categorical_fields] values */
 };
 
 typedef struct Array {
     enum ArrayType *type;
-    union ArrayValue *data;
+    union ArrayColumn *columns;
     size_t shape[2];
+    size_t capacity;    /* rows allocated on each column */
+    size_t stride;      /* distance between two rows of a numeric column */
+    bool row_major;     /* numeric only array, its columns are views of a row-major matrix */
+    double *matrix;     /* storage of row_major arrays, NULL when the array does not own it */
+    char ***values;     /* categorical values of each column (borrowed from Configs) */
+    size_t *n_values;
 } Array;
 
+/* csv or tsv file read by chunks of rows, see csv_stream_read() */
+typedef struct CsvStream {
+    FILE *fp;
+    char *separator;
+    char *line;
+    size_t line_size;
+    char **values;      /* fields of the current line */
+    size_t n_values;
+    size_t line_number;
+    size_t *in_indexes; /* column of each input and label key */
+    size_t *out_indexes;
+    bool has_header;
+    bool read_output;
+} CsvStream;
+
+/* output file written by chunks of rows */
+typedef struct FileWriter {
+    FILE *fp;
+    char *file_format;
+    size_t rows;        /* rows written */
+    bool started;       /* header or array opening written */
+} FileWriter;
 
 void array_free(Array *x);
-void file_read(char *filepath, Array *input, Array *out, struct Configs configs, bool read_output);
+bool array_is_sparse(Array x);
+size_t array_width(Array x);
+void array_set_fields(Array *x, char **keys, size_t n_keys, struct Configs cfgs);
+void sparse_free(Sparse *x);
+void file_read(char *filepath, Array *input, Sparse *sparse_input, Array *out, struct Configs configs, bool read_output);
 void file_write(Array input, Array out, struct Configs ml_configs);
+void file_writer_open(FileWriter *writer, struct Configs ml_configs);
+void file_writer_write(FileWriter *writer, Array input, Array out, struct Configs ml_configs);
+void file_writer_close(FileWriter *writer, struct Configs ml_configs);
 char * file_format_infer(char *filename);
-double * data_preprocess(
-        size_t out_shape[2],
-        Array data,
+int dtoa_shortest(double value, char *digits, int *exponent);
+void csv_stream_open(CsvStream *stream, char *filepath, Array *input, Array *out, struct Configs configs, bool read_output);
+void csv_stream_init(CsvStream *stream, Array *input, Array *out, struct Configs configs);
+size_t csv_stream_read(CsvStream *stream, Array *input, Array *out, struct Configs configs, size_t max_rows);
+void csv_stream_close(CsvStream *stream);
+Tensor data_preprocess(
+        Array *data,
         struct Configs configs,
         bool is_input,
         bool only_allocate);
 
+void data_preprocess_sparse(
+        Sparse *out,
+        Array *data,
+        struct Configs configs);
+
 void data_postprocess(
         Array *out,
-        double *data, size_t data_shape[2],
+        Tensor *data,
         struct Configs cfgs,
         bool is_input);
 #endif
@@ -0,0 +1,203 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "nn.h"
+#include "parse.h"
+#include "pipeline.h"
+
+/* bounded FIFO of chunks between two stages, NULL marks the end of the file */
+struct Queue {
+    Chunk *items[PIPELINE_CHUNKS + 1];
+    size_t head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+struct Stages {
+    Pipeline *pipeline;
+    struct Configs cfg;
+    struct Queue free, parsed, predicted;
+    FileWriter writer;
+};
+
+static void *reader_thread(void *arg);
+static void *writer_thread(void *arg);
+static void predict_chunk(Chunk *chunk, Ensemble *ensemble, struct Configs cfg);
+static void chunk_reset(Chunk *chunk);
+static void queue_init(struct Queue *queue);
+static void queue_destroy(struct Queue *queue);
+static void queue_push(struct Queue *queue, Chunk *chunk);
+static Chunk *queue_pop(struct Queue *queue);
+
+void pipeline_open(Pipeline *pipeline, char *filepath, struct Configs cfg)
+{
+    if (cfg.predict_chunk == 0) die("pipeline_open() Error: predict_chunk must be greater than 0");
+
+    memset(pipeline->chunks, 0, sizeof(pipeline->chunks));
+    csv_stream_open(&pipeline->stream, filepath, &pipeline->chunks[0].in, &pipeline->chunks[0].out, cfg, false);
+    pipeline->in_cols = array_width(pipeline->chunks[0].in);
+}
+
+/* Predict and write every chunk, the calling thread is the compute stage */
+void pipeline_predict(Pipeline *pipeline, Ensemble *ensemble, struct Configs cfg)
+{
+    struct Stages stages = {.pipeline = pipeline, .cfg = cfg};
+    pthread_t reader, writer;
+    Chunk *chunk;
+
+    // the output fields are set again by the reader with cfg
+    array_free(&pipeline->chunks[0].out);
+    pipeline->chunks[0].out = (Array){0};
+
+    queue_init(&stages.free);
+    queue_init(&stages.parsed);
+    queue_init(&stages.predicted);
+    for (size_t i = 0; i < PIPELINE_CHUNKS; i++) queue_push(&stages.free, &pipeline->chunks[i]);
+    file_writer_open(&stages.writer, cfg);
+
+    if (pthread_create(&reader, NULL, reader_thread, &stages)
+        || pthread_create(&writer, NULL, writer_thread, &stages)) {
+        die("pipeline_predict() Error:");
+    }
+
+    while ((chunk = queue_pop(&stages.parsed))) {
+        predict_chunk(chunk, ensemble, cfg);
+        queue_push(&stages.predicted, chunk);
+    }
+    queue_push(&stages.predicted, NULL);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    file_writer_close(&stages.writer, cfg);
+    csv_stream_close(&pipeline->stream);
+
+    queue_destroy(&stages.free);
+    queue_destroy(&stages.parsed);
+    queue_destroy(&stages.predicted);
+    for (size_t i = 0; i < PIPELINE_CHUNKS; i++) {
+        chunk_reset(&pipeline->chunks[i]);
+        array_free(&pipeline->chunks[i].in);
+        array_free(&pipeline->chunks[i].out);
+    }
+}
+
+void *reader_thread(void *arg)
+{
+    struct Stages *stages = arg;
+    size_t rows, max_rows = stages->cfg.predict_chunk;
+    bool first = true;
+
+    do {
+        Chunk *chunk = queue_pop(&stages->free);
+        chunk_reset(chunk);
+        rows = csv_stream_read(&stages->pipeline->stream, &chunk->in, &chunk->out, stages->cfg, max_rows);
+
+        // an empty file still goes through every stage to get its header written
+        if (rows || first) queue_push(&stages->parsed, chunk);
+        else queue_push(&stages->free, chunk);
+        first = false;
+    } while (rows == max_rows);
+
+    queue_push(&stages->parsed, NULL);
+    return NULL;
+}
+
+void *writer_thread(void *arg)
+{
+    struct Stages *stages = arg;
+    Chunk *chunk;
+
+    while ((chunk = queue_pop(&stages->predicted))) {
+        file_writer_write(&stages->writer, chunk->in, chunk->out, stages->cfg);
+        queue_push(&stages->free, chunk);
+    }
+    return NULL;
+}
+
+void predict_chunk(Chunk *chunk, Ensemble *ensemble, struct Configs cfg)
+{
+    Sparse *X_sparse = NULL;
+
+    if (array_is_sparse(chunk->in)) {
+        data_preprocess_sparse(&chunk->X_sparse, &chunk->in, cfg);
+        chunk->X = (Tensor){.shape = {chunk->X_sparse.shape[0], chunk->X_sparse.shape[1]}};
+        X_sparse = &chunk->X_sparse;
+    } else {
+        chunk->X = data_preprocess(&chunk->in, cfg, true, false);
+    }
+    chunk->y = data_preprocess(&chunk->out, cfg, false, true);
+    ensemble_predict(ensemble, &chunk->y, &chunk->X, X_sparse);
+    data_postprocess(&chunk->out, &chunk->y, cfg, false);
+}
+
+/* free the matrices the arrays of the chunk may still point to */
+void chunk_reset(Chunk *chunk)
+{
+    tensor_free(&chunk->X);
+    tensor_free(&chunk->y);
+    sparse_free(&chunk->X_sparse);
+    chunk->X_sparse = (Sparse){0};
+}
+
+void queue_init(struct Queue *queue)
+{
+    queue->head = queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+void queue_destroy(struct Queue *queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+void queue_push(struct Queue *queue, Chunk *chunk)
+{
+    size_t capacity = PIPELINE_CHUNKS + 1;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == capacity) pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->items[(queue->head + queue->count) % capacity] = chunk;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+Chunk *queue_pop(struct Queue *queue)
+{
+    size_t capacity = PIPELINE_CHUNKS + 1;
+    Chunk *chunk;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) pthread_cond_wait(&queue->not_empty, &queue->lock);
+    chunk = queue->items[queue->head];
+    queue->head = (queue->head + 1) % capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return chunk;
+}
@@ -0,0 +1,54 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PIPELINE__
+#define __PIPELINE__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+#include "tensor.h"
+#include "nn.h"
+#include "parse.h"
+#include "ensemble.h"
+
+/* chunks on flight, one on each stage plus one waiting between each pair */
+#define PIPELINE_CHUNKS 5
+
+typedef struct Chunk {
+    Array in, out;
+    Tensor X, y;
+    Sparse X_sparse;
+} Chunk;
+
+/*
+ * Predictions over a csv or tsv file by chunks of predict_chunk rows. A reader
+ * thread parses chunk N + 1 while chunk N is predicted and a writer thread
+ * writes chunk N - 1, chunks keep the file order.
+ */
+typedef struct Pipeline {
+    CsvStream stream;
+    Chunk chunks[PIPELINE_CHUNKS];
+    size_t in_cols;     /* network input width */
+} Pipeline;
+
+void pipeline_open(Pipeline *pipeline, char *filepath, struct Configs cfg);
+/* cfg is the ensemble one, it names the output fields */
+void pipeline_predict(Pipeline *pipeline, Ensemble *ensemble, struct Configs cfg);
+#endif
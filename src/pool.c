@@ -0,0 +1,73 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "blas.h"
+#include "pool.h"
+
+struct Pool {
+    void (*run)(void *arg, size_t job);
+    void *arg;
+    size_t n_jobs, next;
+    pthread_mutex_t lock;
+};
+
+static void *pool_thread(void *arg);
+
+void pool_run(struct Configs cfg, size_t n_jobs, void (*run)(void *, size_t), void *arg)
+{
+    struct Pool pool = {.run = run, .arg = arg, .n_jobs = n_jobs};
+    size_t threads = cfg.sweep_threads;
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    if (threads > n_jobs) threads = n_jobs;
+
+    // the jobs already keep the cores busy
+    if (threads > 1 && cfg.blas_threads == 0) blas_init(NULL, 1);
+
+    pthread_t *workers = ecalloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&pool.lock, NULL);
+    for (size_t i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, pool_thread, &pool)) die("pool_run() Error:");
+    }
+    for (size_t i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+}
+
+void *pool_thread(void *arg)
+{
+    struct Pool *pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t job = pool->next;
+        if (job < pool->n_jobs) pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job == pool->n_jobs) return NULL;
+        pool->run(pool->arg, job);
+    }
+}
@@ -0,0 +1,32 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __POOL__
+#define __POOL__
+
+#include <stddef.h>
+
+#include "util.h"
+
+/*
+ * Run jobs [0, n_jobs) on sweep_threads threads (one per processor when 0),
+ * each thread takes the next job until there are none left. BLAS runs single
+ * threaded meanwhile unless blas_threads is set.
+ */
+void pool_run(struct Configs cfg, size_t n_jobs, void (*run)(void *arg, size_t job), void *arg);
+#endif
@@ -0,0 +1,269 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+#include "nn.h"
+
+/*
+ * Magnitude pruning and the CSR weights kernels. A pruned layer keeps a mask
+ * while it is fine tuned, on predictions layers below the density threshold
+ * replace their dense weights with a CSR copy (rows are the layer inputs).
+ */
+
+static int compare_abs(const void *a, const void *b);
+static void csr_from_dense(Sparse *dest, const nn_float *weights, size_t rows, size_t cols);
+static size_t count_nonzero(const nn_float *values, size_t n);
+
+/* Zero the smallest |weights| of each layer until sparsity of them are zero */
+void nn_network_prune(Layer network[], size_t network_size, double sparsity)
+{
+    if (sparsity < 0 || sparsity >= 1) die("nn_network_prune() Error: sparsity must be on [0, 1) not %g", sparsity);
+
+    for (size_t l = 0; l < network_size; l++) {
+        size_t size = network[l].input_nodes * network[l].neurons;
+        size_t n_pruned = (size_t)(sparsity * size);
+        nn_float *weights = network[l].weights;
+
+        network[l].mask = ecalloc(size, sizeof(uint8_t));
+        if (!n_pruned) {
+            memset(network[l].mask, 1, size);
+            continue;
+        }
+
+        nn_float *sorted = ecalloc(size, sizeof(nn_float));
+        memcpy(sorted, weights, size * sizeof(nn_float));
+        qsort(sorted, size, sizeof(nn_float), compare_abs);
+        nn_float threshold = fabs(sorted[n_pruned - 1]);
+        free(sorted);
+
+        // ties on the threshold are kept while there are weights left to prune
+        size_t pruned = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (fabs(weights[i]) < threshold) {
+                weights[i] = 0;
+                pruned++;
+            } else network[l].mask[i] = 1;
+        }
+        for (size_t i = 0; i < size && pruned < n_pruned; i++) {
+            if (fabs(weights[i]) == threshold) {
+                weights[i] = 0;
+                network[l].mask[i] = 0;
+                pruned++;
+            }
+        }
+    }
+}
+
+/* Keep the pruned weights at zero after each training step */
+void nn_layer_apply_mask(Layer layer, nn_float *weights)
+{
+    size_t size = layer.input_nodes * layer.neurons;
+    for (size_t i = 0; i < size; i++) {
+        if (!layer.mask[i]) weights[i] = 0;
+    }
+}
+
+/* Layers with fewer nonzero weights than density swap them for a CSR copy */
+void nn_network_sparsify(Layer network[], size_t network_size, double density)
+{
+    for (size_t l = 0; l < network_size; l++) {
+        size_t rows = network[l].input_nodes, cols = network[l].neurons;
+        if (network[l].qweights || !network[l].weights) continue;
+
+        size_t nnz = count_nonzero(network[l].weights, rows * cols);
+        if ((double)nnz >= density * rows * cols) continue;
+
+        csr_from_dense(&network[l].sparse_weights, network[l].weights, rows, cols);
+        network[l].weights = NULL;
+    }
+}
+
+/* out = input @ W, each nonzero input adds its stored weights, zero inputs (relu) are skipped */
+void nn_layer_forward_csr(
+        Layer layer,
+        Tensor *out,
+        Tensor *input)
+{
+    if (out->shape[0] != input->shape[0] || out->shape[1] != layer.neurons) {
+        fprintf(stderr,
+                "nn_layer_forward_csr() Error: out must have (%zu x %zu) dimensions not (%zu x %zu)\n",
+                input->shape[0], layer.neurons, out->shape[0], out->shape[1]);
+        exit(1);
+    }
+
+    Sparse *w = &layer.sparse_weights;
+    for (size_t i = 0; i < input->shape[0]; i++) {
+        nn_float *z = TENSOR_ROW(*out, i);
+        nn_float *x = TENSOR_ROW(*input, i);
+        memset(z, 0, layer.neurons * sizeof(nn_float));
+
+        for (size_t k = 0; k < layer.input_nodes; k++) {
+            if (x[k] == 0) continue;
+            for (size_t p = w->indptr[k]; p < w->indptr[k + 1]; p++)
+                z[w->indices[p]] += x[k] * w->values[p];
+        }
+        nn_activation_epilogue(layer.activation, z, NULL, layer.bias, layer.neurons);
+    }
+}
+
+void nn_layer_forward_sparse_csr(
+        Layer layer,
+        Tensor *out,
+        Sparse *input)
+{
+    if (out->shape[0] != input->shape[0] || out->shape[1] != layer.neurons) {
+        fprintf(stderr,
+                "nn_layer_forward_sparse_csr() Error: out must have (%zu x %zu) dimensions not (%zu x %zu)\n",
+                input->shape[0], layer.neurons, out->shape[0], out->shape[1]);
+        exit(1);
+    }
+
+    Sparse *w = &layer.sparse_weights;
+    for (size_t i = 0; i < input->shape[0]; i++) {
+        nn_float *z = TENSOR_ROW(*out, i);
+        memset(z, 0, layer.neurons * sizeof(nn_float));
+
+        for (size_t q = input->indptr[i]; q < input->indptr[i + 1]; q++) {
+            size_t k = input->indices[q];
+            nn_float x = input->values[q];
+            for (size_t p = w->indptr[k]; p < w->indptr[k + 1]; p++)
+                z[w->indices[p]] += x * w->values[p];
+        }
+        nn_activation_epilogue(layer.activation, z, NULL, layer.bias, layer.neurons);
+    }
+}
+
+/*
+ * Pruned weights files have WEIGHTS_SPARSE set on the value size, each layer
+ * stores its shape, number of nonzero weights, row pointers (size_t), column
+ * indexes (uint32_t), nonzero weights and bias.
+ */
+void nn_network_write_weights_sparse(char *filepath, Layer *network, size_t network_size)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL) die("nn_network_write_weights_sparse() Error:");
+
+    uint32_t dtype = sizeof(nn_float) | WEIGHTS_SPARSE;
+    fwrite(WEIGHTS_MAGIC, 1, 4, fp);
+    fwrite(&dtype, sizeof(uint32_t), 1, fp);
+    fwrite(&network_size, sizeof(size_t), 1, fp);
+
+    uint32_t *indices = NULL;
+    for (size_t l = 0; l < network_size; l++) {
+        size_t shape[2] = {network[l].input_nodes, network[l].neurons};
+        Sparse csr = {0};
+
+        csr_from_dense(&csr, network[l].weights, shape[0], shape[1]);
+        size_t nnz = csr.indptr[shape[0]];
+
+        indices = erealloc(indices, (nnz + 1) * sizeof(uint32_t));
+        for (size_t p = 0; p < nnz; p++) indices[p] = csr.indices[p];
+
+        bool ok = fwrite(shape, sizeof(size_t), 2, fp) == 2
+               && fwrite(&nnz, sizeof(size_t), 1, fp) == 1
+               && fwrite(csr.indptr, sizeof(size_t), shape[0] + 1, fp) == shape[0] + 1
+               && fwrite(indices, sizeof(uint32_t), nnz, fp) == nnz
+               && fwrite(csr.values, sizeof(nn_float), nnz, fp) == nnz
+               && fwrite(network[l].bias, sizeof(nn_float), shape[1], fp) == shape[1];
+        free(csr.indptr);
+        free(csr.indices);
+        free(csr.values);
+
+        if (!ok) {
+            fclose(fp);
+            die("nn_network_write_weights_sparse() Error: "
+                "number of written objects does not match with number of objects");
+        }
+    }
+    free(indices);
+    fclose(fp);
+}
+
+/* Read the CSR weights of a layer into its dense weights, values have dtype bytes */
+bool nn_layer_read_sparse(FILE *fp, Layer *layer, uint32_t dtype)
+{
+    size_t rows = layer->input_nodes, cols = layer->neurons, nnz;
+
+    if (fread(&nnz, sizeof(size_t), 1, fp) != 1 || nnz > rows * cols) return false;
+
+    size_t *indptr = ecalloc(rows + 1, sizeof(size_t));
+    uint32_t *indices = ecalloc(nnz + 1, sizeof(uint32_t));
+    nn_float *values = ecalloc(nnz + 1, sizeof(nn_float));
+
+    bool ok = fread(indptr, sizeof(size_t), rows + 1, fp) == rows + 1
+           && indptr[rows] == nnz
+           && fread(indices, sizeof(uint32_t), nnz, fp) == nnz
+           && nn_read_values(fp, values, nnz, dtype) == nnz
+           && nn_read_values(fp, layer->bias, cols, dtype) == cols;
+
+    memset(layer->weights, 0, rows * cols * sizeof(nn_float));
+    for (size_t i = 0; ok && i < rows; i++) {
+        for (size_t p = indptr[i]; p < indptr[i + 1]; p++) {
+            if (p >= nnz || indices[p] >= cols) {
+                ok = false;
+                break;
+            }
+            layer->weights[i * cols + indices[p]] = values[p];
+        }
+    }
+
+    free(indptr);
+    free(indices);
+    free(values);
+    return ok;
+}
+
+void csr_from_dense(Sparse *dest, const nn_float *weights, size_t rows, size_t cols)
+{
+    size_t nnz = count_nonzero(weights, rows * cols);
+
+    dest->indptr = ecalloc(rows + 1, sizeof(size_t));
+    dest->indices = ecalloc(nnz + 1, sizeof(size_t));
+    dest->values = ecalloc(nnz + 1, sizeof(nn_float));
+    dest->shape[0] = rows;
+    dest->shape[1] = cols;
+
+    size_t p = 0;
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) {
+            if (weights[i * cols + j] == 0) continue;
+            dest->indices[p] = j;
+            dest->values[p++] = weights[i * cols + j];
+        }
+        dest->indptr[i + 1] = p;
+    }
+}
+
+size_t count_nonzero(const nn_float *values, size_t n)
+{
+    size_t nnz = 0;
+    for (size_t i = 0; i < n; i++) nnz += (values[i] != 0);
+    return nnz;
+}
+
+int compare_abs(const void *a, const void *b)
+{
+    nn_float x = fabs(*(const nn_float *)a), y = fabs(*(const nn_float *)b);
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,321 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+#include "nn.h"
+
+/*
+ * Post-training int8 quantization. Weights get one scale per neuron (column),
+ * layer inputs one scale per layer taken from the calibration data range.
+ * Products are accumulated on int32 and dequantized before the activation.
+ *
+ * The int8 weights are stored as panels of COL_BLOCK columns, panel p holds
+ * columns [p * COL_BLOCK, (p + 1) * COL_BLOCK) of every row contiguously and
+ * the columns past the neurons are zero.
+ */
+
+#define QMAX 127
+#define CALIBRATION_ROWS 256
+
+#define ROW_BLOCK 4
+#define COL_BLOCK 16
+#define PANEL_COLS(n) (((n) + COL_BLOCK - 1) / COL_BLOCK * COL_BLOCK)
+#define PANEL_INDEX(i, j, k) (((j) / COL_BLOCK * (k) + (i)) * COL_BLOCK + (j) % COL_BLOCK)
+
+// int8 x int8 products fit on int16, even the sum of two of them
+typedef int8_t vint8 __attribute__((vector_size(COL_BLOCK)));
+typedef int16_t vint16 __attribute__((vector_size(COL_BLOCK * 2)));
+typedef int16_t vint16_half __attribute__((vector_size(COL_BLOCK)));
+typedef int32_t vint32 __attribute__((vector_size(COL_BLOCK * 2)));
+
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+static nn_float max_abs(Tensor t);
+static void quantize_layer(Layer *layer, float input_range);
+static void quantize_row(int8_t *dest, const nn_float *src, size_t n, float scale);
+static void gemm_int8(int32_t *acc, const int8_t *x, const int8_t *panels, size_t k, size_t n);
+static inline __attribute__((always_inline)) void widen_add(vint32 acc[2], vint16 products);
+static inline __attribute__((always_inline)) vint16 load_int8(const int8_t *p);
+
+/* Forward the calibration rows in chunks to find each layer input range */
+void nn_network_quantize(
+        Layer network[], size_t network_size,
+        Tensor *input,
+        Sparse *sparse_input)
+{
+    float *ranges = ecalloc(network_size, sizeof(float));
+    Tensor *outs = ecalloc(network_size, sizeof(Tensor));
+    for (size_t l = 0; l < network_size; l++) {
+        outs[l] = tensor_alloc(CALIBRATION_ROWS, network[l].neurons);
+    }
+
+    for (size_t start = 0; start < input->shape[0]; start += CALIBRATION_ROWS) {
+        size_t rows = input->shape[0] - start;
+        if (rows > CALIBRATION_ROWS) rows = CALIBRATION_ROWS;
+
+        Tensor chunk = tensor_rows(*input, start, rows);
+        Sparse sparse_chunk, *sparse_chunk_ptr = NULL;
+
+        if (sparse_input) {
+            sparse_chunk = *sparse_input;
+            sparse_chunk.indptr = sparse_input->indptr + start;
+            sparse_chunk.shape[0] = rows;
+            sparse_chunk_ptr = &sparse_chunk;
+        } else {
+            ranges[0] = fmaxf(ranges[0], max_abs(chunk));
+        }
+
+        nn_forward(outs, NULL, &chunk, sparse_chunk_ptr, network, network_size);
+        for (size_t l = 1; l < network_size; l++) {
+            ranges[l] = fmaxf(ranges[l], max_abs(tensor_rows(outs[l - 1], 0, rows)));
+        }
+    }
+
+    // sparse inputs keep their values, only the weights are quantized
+    if (sparse_input) ranges[0] = QMAX;
+
+    for (size_t l = 0; l < network_size; l++) {
+        quantize_layer(&network[l], ranges[l]);
+        tensor_free(&outs[l]);
+    }
+    free(outs);
+    free(ranges);
+}
+
+void quantize_layer(Layer *layer, float input_range)
+{
+    size_t rows = layer->input_nodes, cols = layer->neurons;
+
+    layer->qweights = ecalloc(rows * PANEL_COLS(cols), sizeof(int8_t));
+    layer->qscales = ecalloc(cols, sizeof(float));
+    layer->qinput_scale = (input_range > 0) ? input_range / QMAX : 1;
+
+    for (size_t j = 0; j < cols; j++) {
+        nn_float range = 0;
+        for (size_t i = 0; i < rows; i++) range = fmax(range, fabs(layer->weights[i * cols + j]));
+
+        layer->qscales[j] = (range > 0) ? range / QMAX : 1;
+        for (size_t i = 0; i < rows; i++) {
+            nn_float q = layer->weights[i * cols + j] / layer->qscales[j];
+            layer->qweights[PANEL_INDEX(i, j, rows)] = (int8_t)lrint(q);
+        }
+    }
+}
+
+void nn_layer_forward_int8(
+        Layer layer,
+        Tensor *out,
+        Tensor *input)
+{
+    if (out->shape[0] != input->shape[0] || out->shape[1] != layer.neurons) {
+        fprintf(stderr,
+                "nn_layer_forward_int8() Error: out must have (%zu x %zu) dimensions not (%zu x %zu)\n",
+                input->shape[0], layer.neurons, out->shape[0], out->shape[1]);
+        exit(1);
+    }
+
+    size_t k = layer.input_nodes, n = layer.neurons, n_panels = PANEL_COLS(n);
+    int8_t *qinput = ecalloc(ROW_BLOCK * k, sizeof(int8_t));
+    int32_t *acc = ecalloc(ROW_BLOCK * n_panels, sizeof(int32_t));
+
+    for (size_t i = 0; i < input->shape[0]; i += ROW_BLOCK) {
+        size_t rows = input->shape[0] - i;
+        if (rows > ROW_BLOCK) rows = ROW_BLOCK;
+
+        // the last block is padded with zero rows
+        memset(qinput, 0, ROW_BLOCK * k);
+        for (size_t r = 0; r < rows; r++) {
+            quantize_row(qinput + r * k, TENSOR_ROW(*input, i + r), k, layer.qinput_scale);
+        }
+        gemm_int8(acc, qinput, layer.qweights, k, n_panels);
+
+        for (size_t r = 0; r < rows; r++) {
+            nn_float *z = TENSOR_ROW(*out, i + r);
+            for (size_t j = 0; j < n; j++)
+                z[j] = (nn_float)acc[r * n_panels + j] * (layer.qinput_scale * layer.qscales[j]);
+            nn_activation_epilogue(layer.activation, z, NULL, layer.bias, n);
+        }
+    }
+
+    free(qinput);
+    free(acc);
+}
+
+/* Sparse inputs stay as floats, the int8 weight rows are looked up and scaled once per row */
+void nn_layer_forward_sparse_int8(
+        Layer layer,
+        Tensor *out,
+        Sparse *input)
+{
+    if (out->shape[0] != input->shape[0] || out->shape[1] != layer.neurons) {
+        fprintf(stderr,
+                "nn_layer_forward_sparse_int8() Error: out must have (%zu x %zu) dimensions not (%zu x %zu)\n",
+                input->shape[0], layer.neurons, out->shape[0], out->shape[1]);
+        exit(1);
+    }
+
+    size_t k = layer.input_nodes;
+    for (size_t i = 0; i < input->shape[0]; i++) {
+        nn_float *z = TENSOR_ROW(*out, i);
+        memset(z, 0, layer.neurons * sizeof(nn_float));
+
+        for (size_t p = input->indptr[i]; p < input->indptr[i + 1]; p++) {
+            nn_float value = input->values[p];
+            for (size_t j = 0; j < layer.neurons; j++)
+                z[j] += value * layer.qweights[PANEL_INDEX(input->indices[p], j, k)];
+        }
+
+        for (size_t j = 0; j < layer.neurons; j++) z[j] *= layer.qscales[j];
+        nn_activation_epilogue(layer.activation, z, NULL, layer.bias, layer.neurons);
+    }
+}
+
+/*
+ * acc[ROW_BLOCK x n] = x[ROW_BLOCK x k] @ panels[k x n], each panel keeps its
+ * accumulators on registers along the whole k loop and widens to int32 once
+ * every two products.
+ */
+KERNEL_CLONES
+void gemm_int8(int32_t *acc, const int8_t *x, const int8_t *panels, size_t k, size_t n)
+{
+    const int8_t *x0 = x, *x1 = x + k, *x2 = x + 2 * k, *x3 = x + 3 * k;
+
+    for (size_t j = 0; j < n; j += COL_BLOCK) {
+        const int8_t *panel = panels + j * k;
+        vint32 a0[2] = {0}, a1[2] = {0}, a2[2] = {0}, a3[2] = {0};
+        size_t i = 0;
+
+        for (; i + 1 < k; i += 2) {
+            vint16 c0 = load_int8(panel + i * COL_BLOCK);
+            vint16 c1 = load_int8(panel + (i + 1) * COL_BLOCK);
+            widen_add(a0, c0 * x0[i] + c1 * x0[i + 1]);
+            widen_add(a1, c0 * x1[i] + c1 * x1[i + 1]);
+            widen_add(a2, c0 * x2[i] + c1 * x2[i + 1]);
+            widen_add(a3, c0 * x3[i] + c1 * x3[i + 1]);
+        }
+        if (i < k) {
+            vint16 c0 = load_int8(panel + i * COL_BLOCK);
+            widen_add(a0, c0 * x0[i]);
+            widen_add(a1, c0 * x1[i]);
+            widen_add(a2, c0 * x2[i]);
+            widen_add(a3, c0 * x3[i]);
+        }
+
+        memcpy(acc + j, a0, sizeof(a0));
+        memcpy(acc + n + j, a1, sizeof(a1));
+        memcpy(acc + 2 * n + j, a2, sizeof(a2));
+        memcpy(acc + 3 * n + j, a3, sizeof(a3));
+    }
+}
+
+void widen_add(vint32 acc[2], vint16 products)
+{
+    vint16_half half[2];
+    memcpy(half, &products, sizeof(products));
+    acc[0] += __builtin_convertvector(half[0], vint32);
+    acc[1] += __builtin_convertvector(half[1], vint32);
+}
+
+vint16 load_int8(const int8_t *p)
+{
+    vint8 v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_convertvector(v, vint16);
+}
+
+void quantize_row(int8_t *dest, const nn_float *src, size_t n, float scale)
+{
+    nn_float inv_scale = 1 / (nn_float)scale;
+    for (size_t i = 0; i < n; i++) {
+        nn_float q = nearbyint(src[i] * inv_scale);
+        dest[i] = (int8_t)((q > QMAX) ? QMAX : (q < -QMAX) ? -QMAX : q);
+    }
+}
+
+nn_float max_abs(Tensor t)
+{
+    nn_float max = 0;
+    for (size_t i = 0; i < t.shape[0]; i++) {
+        nn_float *row = TENSOR_ROW(t, i);
+        for (size_t j = 0; j < t.shape[1]; j++) max = fmax(max, fabs(row[j]));
+    }
+    return max;
+}
+
+/*
+ * int8 weights files share the header of nn_network_write_weights() with a
+ * value size of 1, each layer stores its shape, input scale, neuron scales,
+ * int8 weight panels and float32 bias.
+ */
+void nn_network_write_weights_int8(char *filepath, Layer *network, size_t network_size)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL) die("nn_network_write_weights_int8() Error:");
+
+    uint32_t dtype = WEIGHTS_INT8;
+    fwrite(WEIGHTS_MAGIC, 1, 4, fp);
+    fwrite(&dtype, sizeof(uint32_t), 1, fp);
+    fwrite(&network_size, sizeof(size_t), 1, fp);
+
+    float *bias = NULL;
+    for (size_t i = 0; i < network_size; i++) {
+        size_t shape[2] = {network[i].input_nodes, network[i].neurons};
+        size_t size = shape[0] * PANEL_COLS(shape[1]);
+
+        bias = erealloc(bias, shape[1] * sizeof(float));
+        for (size_t j = 0; j < shape[1]; j++) bias[j] = network[i].bias[j];
+
+        if (fwrite(shape, sizeof(size_t), 2, fp) != 2
+            || fwrite(&network[i].qinput_scale, sizeof(float), 1, fp) != 1
+            || fwrite(network[i].qscales, sizeof(float), shape[1], fp) != shape[1]
+            || fwrite(network[i].qweights, sizeof(int8_t), size, fp) != size
+            || fwrite(bias, sizeof(float), shape[1], fp) != shape[1]) {
+            fclose(fp);
+            die("nn_network_write_weights_int8() Error: "
+                "number of written objects does not match with number of objects");
+        }
+    }
+    free(bias);
+    fclose(fp);
+}
+
+/* Read the layer body of an int8 weights file, it replaces the float weights */
+bool nn_layer_read_int8(FILE *fp, Layer *layer)
+{
+    size_t size = layer->input_nodes * PANEL_COLS(layer->neurons);
+    float *bias = ecalloc(layer->neurons, sizeof(float));
+
+    layer->weights = NULL;
+    layer->qweights = ecalloc(size, sizeof(int8_t));
+    layer->qscales = ecalloc(layer->neurons, sizeof(float));
+
+    bool ok = fread(&layer->qinput_scale, sizeof(float), 1, fp) == 1
+           && fread(layer->qscales, sizeof(float), layer->neurons, fp) == layer->neurons
+           && fread(layer->qweights, sizeof(int8_t), size, fp) == size
+           && fread(bias, sizeof(float), layer->neurons, fp) == layer->neurons;
+
+    for (size_t j = 0; j < layer->neurons; j++) layer->bias[j] = bias[j];
+    free(bias);
+    return ok;
+}
@@ -0,0 +1,384 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "nn.h"
+#include "blas.h"
+#include "pool.h"
+#include "sweep.h"
+
+// each tune trial warms up for an epoch over TUNE_ROWS rows and then trains
+// TUNE_EPOCHS epochs at a time for at least TUNE_SECONDS
+#define TUNE_ROWS 8192
+#define TUNE_EPOCHS 2
+#define TUNE_SECONDS 0.2
+
+static const size_t TUNE_BATCHES[] = {8, 16, 32, 64, 128, 256, 512};
+
+/* data shared read-only by every model trained */
+struct Data {
+    Tensor *X, *y;
+    Sparse *X_sparse;
+};
+
+struct Variant {
+    struct Configs cfg;         /* owns its neurons and activations arrays */
+    size_t *value_index;        /* value taken from each sweep key */
+    char *weights_filepath;
+    nn_float loss;
+    double seconds;
+};
+
+struct Sweep {
+    struct Data data;
+    struct Variant *variants;
+};
+
+struct Fold {
+    size_t start, rows;         /* validation rows, the model trains on the others */
+    nn_float loss;
+    double seconds;
+};
+
+struct CrossValidation {
+    struct Data data;
+    struct Configs cfg;
+    struct Fold *folds;
+};
+
+struct Trial {
+    const char *backend;
+    int threads;
+    size_t batch_size;
+    double samples_per_second;
+};
+
+static void check_labels(struct Configs cfg, Tensor *y);
+static size_t variants_count(struct Configs cfg);
+static void variant_init(struct Variant *variant, struct Configs cfg, size_t index);
+static void variant_free(struct Variant *variant);
+static void variant_train(void *arg, size_t index);
+static char *variant_weights_path(char *filepath, size_t index);
+static void fold_train(void *arg, size_t index);
+static void tune_trial(struct Trial *trial, struct Configs cfg, struct Data *data);
+static int next_threads(int threads, int max_threads);
+static Sparse sparse_rows(Sparse x, size_t start, size_t rows);
+static FILE *metrics_open(struct Configs cfg);
+static void metrics_close(FILE *fp);
+static double now(void);
+
+void sweep_run(struct Configs cfg, Tensor *X, Sparse *X_sparse, Tensor *y)
+{
+    struct Sweep sweep = {.data = {.X = X, .X_sparse = X_sparse, .y = y}};
+    size_t n_variants;
+
+    if (cfg.n_sweep_keys == 0) die("sweep_run() Error: there is no [sweep] section on the config file");
+    if (!cfg.weights_filepath) die("sweep_run() Error: weights_path is not defined");
+    check_labels(cfg, y);
+
+    n_variants = variants_count(cfg);
+    sweep.variants = ecalloc(n_variants, sizeof(struct Variant));
+    for (size_t i = 0; i < n_variants; i++) variant_init(&sweep.variants[i], cfg, i);
+
+    pool_run(cfg, n_variants, variant_train, &sweep);
+
+    FILE *fp = metrics_open(cfg);
+    fprintf(fp, "variant");
+    for (size_t k = 0; k < cfg.n_sweep_keys; k++) fprintf(fp, ",%s", cfg.sweep_keys[k]);
+    fprintf(fp, ",loss,seconds,weights\n");
+    for (size_t i = 0; i < n_variants; i++) {
+        struct Variant *variant = &sweep.variants[i];
+        fprintf(fp, "%zu", i);
+        for (size_t k = 0; k < cfg.n_sweep_keys; k++) {
+            fprintf(fp, ",%s", cfg.sweep_values[k][variant->value_index[k]]);
+        }
+        fprintf(fp, ",%.9g,%.3f,%s\n", (double)variant->loss, variant->seconds, variant->weights_filepath);
+    }
+    metrics_close(fp);
+
+    for (size_t i = 0; i < n_variants; i++) variant_free(&sweep.variants[i]);
+    free(sweep.variants);
+}
+
+void cv_run(struct Configs cfg, Tensor *X, Sparse *X_sparse, Tensor *y)
+{
+    struct CrossValidation cv = {.data = {.X = X, .X_sparse = X_sparse, .y = y}, .cfg = cfg};
+    size_t k = cfg.folds, samples = X->shape[0];
+    double loss = 0, seconds = 0;
+
+    if (k < 2 || k > samples) die("cv_run() Error: folds must be between 2 and the %zu rows", samples);
+    check_labels(cfg, y);
+
+    cv.cfg.quiet = true;
+    cv.cfg.prefetch = 0;
+    cv.folds = ecalloc(k, sizeof(struct Fold));
+    for (size_t f = 0; f < k; f++) {
+        cv.folds[f].start = f * samples / k;
+        cv.folds[f].rows = (f + 1) * samples / k - cv.folds[f].start;
+    }
+
+    pool_run(cfg, k, fold_train, &cv);
+
+    FILE *fp = metrics_open(cfg);
+    fprintf(fp, "fold,rows,loss,seconds\n");
+    for (size_t f = 0; f < k; f++) {
+        fprintf(fp, "%zu,%zu,%.9g,%.3f\n", f, cv.folds[f].rows, (double)cv.folds[f].loss, cv.folds[f].seconds);
+        loss += cv.folds[f].loss;
+        seconds += cv.folds[f].seconds;
+    }
+    fprintf(fp, "mean,%zu,%.9g,%.3f\n", samples, loss / k, seconds / k);
+    metrics_close(fp);
+    free(cv.folds);
+}
+
+void tune_run(struct Configs cfg, Tensor *X, Sparse *X_sparse, Tensor *y)
+{
+    size_t rows = (X->shape[0] < TUNE_ROWS) ? X->shape[0] : TUNE_ROWS;
+    Tensor X_sample = tensor_rows(*X, 0, rows), y_sample = tensor_rows(*y, 0, rows);
+    Sparse X_sparse_sample = (X_sparse) ? sparse_rows(*X_sparse, 0, rows) : (Sparse){0};
+    struct Data data = {.X = &X_sample, .y = &y_sample, .X_sparse = (X_sparse) ? &X_sparse_sample : NULL};
+    struct Trial best = {0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    check_labels(cfg, y);
+    if (rows < TUNE_BATCHES[0]) die("tune_run() Error: tune needs at least %zu rows", TUNE_BATCHES[0]);
+    if (cpus < 1) cpus = 1;
+    cfg.quiet = true;
+
+    for (size_t b = 0; blas_backend_name(b); b++) {
+        const char *backend = blas_backend_name(b);
+        // the internal kernels run on the calling thread
+        int max_threads = (strcmp(backend, "internal")) ? (int)cpus : 1;
+
+        for (int threads = 1; threads <= max_threads; threads = next_threads(threads, max_threads)) {
+            for (size_t i = 0; i < sizeof(TUNE_BATCHES) / sizeof(TUNE_BATCHES[0]) && TUNE_BATCHES[i] <= rows; i++) {
+                struct Trial trial = {.backend = backend, .threads = threads, .batch_size = TUNE_BATCHES[i]};
+
+                tune_trial(&trial, cfg, &data);
+                fprintf(stderr, "tune: %s %d threads batch %zu: %.0f samples/s\n",
+                        backend, threads, trial.batch_size, trial.samples_per_second);
+                if (trial.samples_per_second > best.samples_per_second) best = trial;
+            }
+        }
+    }
+
+    FILE *fp = metrics_open(cfg);
+    fprintf(fp, "# ml tune: %.0f samples/s over %zu rows\n", best.samples_per_second, rows);
+    fprintf(fp, "[net]\n");
+    fprintf(fp, "batch = %zu\n", best.batch_size);
+    fprintf(fp, "blas = %s\n", best.backend);
+    fprintf(fp, "blas_threads = %d\n", best.threads);
+    metrics_close(fp);
+}
+
+void check_labels(struct Configs cfg, Tensor *y)
+{
+    if (y->shape[1] != cfg.neurons[cfg.network_size - 1]) {
+        die("check_labels() Error: data has %zu labels, out layer has %zu neurons",
+            y->shape[1], cfg.neurons[cfg.network_size - 1]);
+    }
+}
+
+size_t variants_count(struct Configs cfg)
+{
+    size_t count = (cfg.sweep_list) ? cfg.n_sweep_values[0] : 1;
+
+    for (size_t k = 0; k < cfg.n_sweep_keys; k++) {
+        if (!cfg.sweep_list) count *= cfg.n_sweep_values[k];
+        else if (cfg.n_sweep_values[k] != count) {
+            die("sweep_run() Error: list sweep '%s' has %zu values, '%s' has %zu",
+                cfg.sweep_keys[k], cfg.n_sweep_values[k], cfg.sweep_keys[0], count);
+        }
+    }
+    return count;
+}
+
+/* cfg with the values of variant index, on a grid the last key changes first */
+void variant_init(struct Variant *variant, struct Configs cfg, size_t index)
+{
+    size_t layer, rest = index, network_size = cfg.network_size;
+
+    variant->cfg = cfg;
+    variant->cfg.quiet = true;
+    variant->cfg.prefetch = 0;
+    variant->cfg.neurons = ecalloc(network_size, sizeof(size_t));
+    variant->cfg.activations = ecalloc(network_size, sizeof(char *));
+    memcpy(variant->cfg.neurons, cfg.neurons, network_size * sizeof(size_t));
+    memcpy(variant->cfg.activations, cfg.activations, network_size * sizeof(char *));
+    variant->value_index = ecalloc(cfg.n_sweep_keys, sizeof(size_t));
+
+    for (size_t k = cfg.n_sweep_keys; k-- > 0;) {
+        size_t i = (cfg.sweep_list) ? index : rest % cfg.n_sweep_values[k];
+        char *key = cfg.sweep_keys[k], *value = cfg.sweep_values[k][i];
+
+        rest /= cfg.n_sweep_values[k];
+        variant->value_index[k] = i;
+        if (!strcmp(key, "alpha"))          variant->cfg.alpha = atof(value);
+        else if (!strcmp(key, "epochs"))    variant->cfg.epochs = (size_t)atol(value);
+        else if (!strcmp(key, "batch"))     variant->cfg.batch_size = (size_t)atol(value);
+        else if (sscanf(key, "neurons.%zu", &layer) == 1) {
+            if (layer == 0 || layer >= network_size) die("sweep_run() Error: '%s' is not a hidden layer", key);
+            variant->cfg.neurons[layer - 1] = (size_t)atol(value);
+        } else if (sscanf(key, "activation.%zu", &layer) == 1) {
+            if (layer == 0 || layer > network_size) die("sweep_run() Error: '%s' is not a layer", key);
+            variant->cfg.activations[layer - 1] = value;
+        }
+    }
+    if (variant->cfg.batch_size == 0) die("sweep_run() Error: batch must be greater than 0");
+
+    free(load_network(variant->cfg)); // fail on unknown activations before training
+    variant->weights_filepath = variant_weights_path(cfg.weights_filepath, index);
+}
+
+void variant_free(struct Variant *variant)
+{
+    free(variant->cfg.neurons);
+    free(variant->cfg.activations);
+    free(variant->value_index);
+    free(variant->weights_filepath);
+}
+
+void variant_train(void *arg, size_t index)
+{
+    struct Sweep *sweep = arg;
+    struct Data *data = &sweep->data;
+    struct Variant *variant = &sweep->variants[index];
+    size_t network_size = variant->cfg.network_size;
+    Layer *network = load_network(variant->cfg);
+    double start = now();
+
+    nn_network_init_weights(network, network_size, data->X->shape[1], true);
+    nn_network_train(network, variant->cfg, data->X, data->X_sparse, data->y);
+    variant->seconds = now() - start;
+    variant->loss = nn_network_loss(network, variant->cfg, data->X, data->X_sparse, data->y);
+    nn_network_write_weights(variant->weights_filepath, network, network_size);
+    fprintf(stderr, "sweep: variant %zu loss %g in %.3fs, weights saved on '%s'\n",
+            index, (double)variant->loss, variant->seconds, variant->weights_filepath);
+
+    nn_network_free_weights(network, network_size);
+    free(network);
+}
+
+/* weights.bin -> weights.<index>.bin */
+char *variant_weights_path(char *filepath, size_t index)
+{
+    char *slash = strrchr(filepath, '/'), *dot = strrchr(filepath, '.');
+    char *name = (slash) ? slash + 1 : filepath;
+    size_t stem = (dot && dot > name) ? (size_t)(dot - filepath) : strlen(filepath);
+    size_t size = strlen(filepath) + 24;
+    char *path = ecalloc(size, sizeof(char));
+
+    snprintf(path, size, "%.*s.%zu%s", (int)stem, filepath, index, filepath + stem);
+    return path;
+}
+
+/* Train on every row out of the fold and take the loss over the fold rows */
+void fold_train(void *arg, size_t index)
+{
+    struct CrossValidation *cv = arg;
+    struct Data *data = &cv->data;
+    struct Fold *fold = &cv->folds[index];
+    size_t network_size = cv->cfg.network_size, samples = data->X->shape[0];
+    size_t n_rows = 0, *rows = ecalloc(samples - fold->rows, sizeof(size_t));
+    Layer *network = load_network(cv->cfg);
+    double start = now();
+
+    for (size_t i = 0; i < fold->start; i++) rows[n_rows++] = i;
+    for (size_t i = fold->start + fold->rows; i < samples; i++) rows[n_rows++] = i;
+
+    nn_network_init_weights(network, network_size, data->X->shape[1], true);
+    nn_network_train_rows(network, cv->cfg, data->X, data->X_sparse, data->y, rows, n_rows);
+    fold->seconds = now() - start;
+
+    Tensor X_fold = tensor_rows(*data->X, fold->start, fold->rows);
+    Tensor y_fold = tensor_rows(*data->y, fold->start, fold->rows);
+    Sparse X_sparse_fold = (data->X_sparse) ? sparse_rows(*data->X_sparse, fold->start, fold->rows) : (Sparse){0};
+    fold->loss = nn_network_loss(network, cv->cfg, &X_fold, (data->X_sparse) ? &X_sparse_fold : NULL, &y_fold);
+    fprintf(stderr, "cv: fold %zu loss %g in %.3fs\n", index, (double)fold->loss, fold->seconds);
+
+    nn_network_free_weights(network, network_size);
+    free(network);
+    free(rows);
+}
+
+/* Training samples per second after a warm up epoch */
+void tune_trial(struct Trial *trial, struct Configs cfg, struct Data *data)
+{
+    size_t network_size = cfg.network_size, samples = 0;
+    Layer *network = load_network(cfg);
+    double start, seconds;
+
+    blas_init(trial->backend, trial->threads);
+    cfg.batch_size = trial->batch_size;
+    nn_network_init_weights(network, network_size, data->X->shape[1], true);
+
+    cfg.epochs = 1;
+    nn_network_train(network, cfg, data->X, data->X_sparse, data->y);
+    cfg.epochs = TUNE_EPOCHS;
+    start = now();
+    do {
+        nn_network_train(network, cfg, data->X, data->X_sparse, data->y);
+        samples += TUNE_EPOCHS * data->X->shape[0];
+    } while ((seconds = now() - start) < TUNE_SECONDS);
+    trial->samples_per_second = samples / seconds;
+
+    nn_network_free_weights(network, network_size);
+    free(network);
+}
+
+/* 1, 2, 4, ... and max_threads last */
+int next_threads(int threads, int max_threads)
+{
+    return (threads < max_threads && threads * 2 > max_threads) ? max_threads : threads * 2;
+}
+
+/* View of rows [start, start + rows) of x, indptr keeps indexing the whole arrays */
+Sparse sparse_rows(Sparse x, size_t start, size_t rows)
+{
+    x.indptr += start;
+    x.shape[0] = rows;
+    return x;
+}
+
+FILE *metrics_open(struct Configs cfg)
+{
+    if (!cfg.out_filepath || !strcmp(cfg.out_filepath, "-")) return stdout;
+
+    FILE *fp = fopen(cfg.out_filepath, "w");
+    if (!fp) die("metrics_open() Error:");
+    return fp;
+}
+
+void metrics_close(FILE *fp)
+{
+    if (fp != stdout) fclose(fp);
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,52 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SWEEP__
+#define __SWEEP__
+
+#include "util.h"
+#include "tensor.h"
+#include "nn.h"
+
+/*
+ * Models are trained at once on a pool of sweep_threads threads (one per
+ * processor when 0) sharing X and y read-only.
+ *
+ * Train every variant of the [sweep] section. A grid sweep trains every combination of
+ * the listed values, a list sweep takes the i-th value of every key. Variant i
+ * weights are saved on weights_path with i before its extension and a csv row
+ * of its values, final loss and training time is written on cfg.out_filepath
+ * (stdout by default).
+ */
+void sweep_run(struct Configs cfg, Tensor *X, Sparse *X_sparse, Tensor *y);
+
+/*
+ * K-fold cross validation, fold i holds the i-th contiguous run of rows. The
+ * cfg.folds models train in parallel on index lists of the rows out of their
+ * fold, the csv with the validation loss of every fold and their mean is
+ * written on cfg.out_filepath (stdout by default).
+ */
+void cv_run(struct Configs cfg, Tensor *X, Sparse *X_sparse, Tensor *y);
+
+/*
+ * Time short training runs over the first rows of X on every BLAS backend,
+ * thread count and batch size, one after the other, and write the fastest as
+ * [net] config keys on cfg.out_filepath (stdout by default).
+ */
+void tune_run(struct Configs cfg, Tensor *X, Sparse *X_sparse, Tensor *y);
+#endif
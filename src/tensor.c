@@ -0,0 +1,72 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "tensor.h"
+
+// rows spanning a multiple of this many bytes would map to the same cache sets
+#define ALIASING_STRIDE 4096
+
+static size_t padded_ld(size_t cols);
+
+/* Zeroed (rows x cols) tensor, rows wider than a cache line start on one */
+Tensor tensor_alloc(size_t rows, size_t cols)
+{
+    Tensor t = {.shape = {rows, cols}, .ld = padded_ld(cols)};
+    t.align = (t.ld * sizeof(nn_float) % TENSOR_ALIGN) ? sizeof(nn_float) : TENSOR_ALIGN;
+    t.data = ealigned_calloc(TENSOR_ALIGN, rows * t.ld, sizeof(nn_float));
+    return t;
+}
+
+/* Tensor over memory allocated elsewhere, only element alignment is assumed */
+Tensor tensor_wrap(nn_float *data, size_t rows, size_t cols, size_t ld)
+{
+    if (ld < cols) die("tensor_wrap() Error: leading dimension %zu is smaller than %zu columns", ld, cols);
+    return (Tensor){.data = data, .shape = {rows, cols}, .ld = ld, .align = sizeof(nn_float)};
+}
+
+/* View of rows [start, start + rows) of t */
+Tensor tensor_rows(Tensor t, size_t start, size_t rows)
+{
+    if (start + rows > t.shape[0]) {
+        die("tensor_rows() Error: rows [%zu, %zu) are out of a %zu rows tensor", start, start + rows, t.shape[0]);
+    }
+    if (t.data) t.data += start * t.ld;
+    t.shape[0] = rows;
+    return t;
+}
+
+void tensor_free(Tensor *t)
+{
+    free(t->data);
+    t->data = NULL;
+    t->shape[0] = t->shape[1] = 0;
+}
+
+size_t padded_ld(size_t cols)
+{
+    size_t line = TENSOR_ALIGN / sizeof(nn_float);
+    if (cols < line) return cols;
+
+    size_t ld = (cols + line - 1) / line * line;
+    if (ld * sizeof(nn_float) % ALIASING_STRIDE == 0) ld += line;
+    return ld;
+}
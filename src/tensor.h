@@ -0,0 +1,45 @@
+/**
+ * ml - a neural network processor written with C
+ * Copyright (C) 2023  jvech
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TENSOR__
+#define __TENSOR__
+
+#include <stddef.h>
+
+#include "util.h"
+
+#define TENSOR_ALIGN 64
+
+/*
+ * Row major matrix, row i starts at data + i * ld. Every row start is aligned
+ * to align bytes. Views share the data of another tensor and are not freed.
+ */
+typedef struct Tensor {
+    nn_float *data;
+    size_t shape[2];
+    size_t ld;
+    size_t align;
+} Tensor;
+
+#define TENSOR_ROW(t, i) ((t).data + (i) * (t).ld)
+
+Tensor tensor_alloc(size_t rows, size_t cols);
+Tensor tensor_wrap(nn_float *data, size_t rows, size_t cols, size_t ld);
+Tensor tensor_rows(Tensor t, size_t start, size_t rows);
+void tensor_free(Tensor *t);
+#endif
@@ -32,6 +32,7 @@ static void load_net_cfgs(struct Configs *cfg, char *key, char *value, char *str
 static void load_lyr_cfgs(struct Configs *cfg, char *key, char *value, char *filepath);
 static void load_categorical_cfgs(struct Configs *cfg, char *key, char *value, char *strtok_ptr);
 static void load_preprocess_cfgs(struct Configs *cfg, char *key, char *value, char *strtok_ptr, char *filepath);
+static void load_sweep_cfgs(struct Configs *cfg, char *key, char *value, char *strtok_ptr, char *filepath);
 static void add_lyr(struct Configs *cfg);
 
 void die(const char *fmt, ...)
@@ -70,6 +71,17 @@ void * ecalloc(size_t nmemb, size_t size)
 	return p;
 }
 
+/* zeroed memory starting on an alignment boundary, release it with free() */
+void * ealigned_calloc(size_t alignment, size_t nmemb, size_t size)
+{
+	void *p;
+	size_t bytes = (nmemb * size + alignment - 1) / alignment * alignment;
+
+	if (!(p = aligned_alloc(alignment, bytes ? bytes : alignment)))
+		die("aligned_alloc:");
+	return memset(p, 0, bytes);
+}
+
 char *e_strdup(const char *s)
 {
     char *out = strdup(s);
@@ -96,7 +108,15 @@ void usage(int exit_code)
     FILE *fp = (!exit_code) ? stdout : stderr;
     fprintf(fp,
             "Usage: ml [re]train [Options] FILE\n"
-            "   or: ml predict [-Ohv] [-f FORMAT] [-o FILE] [-p INT] FILE\n"
+            "   or: ml predict [-MOhv] [-f FORMAT] [-o FILE] [-p INT] [-w WEIGHTS]... FILE\n"
+            "   or: ml predict [Options] [-j JOBS] [-l LIST] -o DIR [FILE]...\n"
+            "   or: ml quantize [-f FORMAT] -o FILE FILE\n"
+            "   or: ml prune [-s SPARSITY] [-e EPOCHS] -o FILE FILE\n"
+            "   or: ml preprocess [-f FORMAT] -o FILE FILE\n"
+            "   or: ml export-c -o FILE WEIGHTS\n"
+            "   or: ml sweep [-o FILE] FILE\n"
+            "   or: ml cv [-k FOLDS] [-o FILE] FILE\n"
+            "   or: ml tune [-o FILE] FILE\n"
             "\n"
             "Options:\n"
             "  -h, --help               Show this message\n"
@@ -105,11 +125,18 @@ void usage(int exit_code)
             "  -a, --alpha=ALPHA        Learning rate (only works with train)\n"
             "  -b, --batch=INT          Select batch size [default: 32] (only works with train)\n"
             "  -c, --config=FILE        Configuration filepath [default=~/.config/ml/ml.cfg]\n"
+            "  -C, --compact            Write JSON without indentation (only works with predict)\n"
             "  -e, --epochs=EPOCHS      Epochs to train the model (only works with train)\n"
-            "  -o, --output=FILE        Output file (only works with predict)\n"
+            "  -k, --folds=FOLDS        Cross validation folds [default: 5] (only works with cv)\n"
+            "  -o, --output=FILE        Output file or directory of the command\n"
             "  -p, --precision=INT      Decimals output precision (only works with predict)\n"
-            "                           [default=auto]\n"
+            "                           [default=auto: 6 digits on csv and tsv, shortest round trip on json]\n"
+            "  -s, --sparsity=SPARSITY  Fraction of weights to prune [default: 0.5] (only works with prune)\n"
             "  -S, --no-shuffle         Don't shuffle data each epoch (only works with train)\n"
+            "  -w, --weights=FILE       Weights file, repeat it to average several models (only works with predict)\n"
+            "  -M, --each-model         Write the output of every -w model (only works with predict)\n"
+            "  -l, --list=FILE          Files to predict, one \"INPUT[<TAB>OUTPUT]\" per line (only works with predict)\n"
+            "  -j, --jobs=INT           Files predicted at once, 0 is one per processor [default: 1]\n"
             "\n"
            );
     exit(exit_code);
@@ -129,13 +156,21 @@ void util_load_cli(struct Configs *ml, int argc, char *argv[])
         {"output",      required_argument,  0, 'o'},
         {"config",      required_argument,  0, 'c'},
         {"only-out",    no_argument,        0, 'O'},
+        {"compact",     no_argument,        0, 'C'},
         {"precision",   required_argument,  0, 'p'},
+        {"sparsity",    required_argument,  0, 's'},
+        {"folds",       required_argument,  0, 'k'},
+        {"weights",     required_argument,  0, 'w'},
+        {"each-model",  no_argument,        0, 'M'},
+        {"list",        required_argument,  0, 'l'},
+        {"jobs",        required_argument,  0, 'j'},
         {0,             0,                  0,  0 },
     };
     int c;
 
+    ml->n_weights_filepaths = 0; // the options are read twice
     while (1) {
-        c = getopt_long(argc, argv, "hvOSc:e:a:o:i:f:p:b:", long_opts, NULL);
+        c = getopt_long(argc, argv, "hvOSCMc:e:a:o:i:f:p:b:s:k:w:l:j:", long_opts, NULL);
 
         if (c == -1) {
             break;
@@ -159,6 +194,9 @@ void util_load_cli(struct Configs *ml, int argc, char *argv[])
         case 'O':
             ml->only_out = true;
             break;
+        case 'C':
+            ml->compact = true;
+            break;
         case 'p':
             ml->decimal_precision = (!strcmp("auto", optarg))? -1: (int)atoi(optarg);
             break;
@@ -169,6 +207,25 @@ void util_load_cli(struct Configs *ml, int argc, char *argv[])
         case 'S':
             ml->shuffle = false;
             break;
+        case 's':
+            ml->sparsity = atof(optarg);
+            break;
+        case 'k':
+            ml->folds = (size_t)atol(optarg);
+            break;
+        case 'w':
+            ml->weights_filepaths = erealloc(ml->weights_filepaths, (ml->n_weights_filepaths + 1) * sizeof(char *));
+            ml->weights_filepaths[ml->n_weights_filepaths++] = optarg;
+            break;
+        case 'M':
+            ml->each_model = true;
+            break;
+        case 'l':
+            ml->list_filepath = optarg;
+            break;
+        case 'j':
+            ml->jobs = (size_t)atol(optarg);
+            break;
         case 'h':
             usage(0);
             break;
@@ -183,7 +240,9 @@ void util_load_cli(struct Configs *ml, int argc, char *argv[])
 
     argv += optind;
     argc -= optind;
-    if (argc != 2) usage(1);
+    if (argc < 1) usage(1);
+    // predict takes several files or none besides a list
+    if (!strcmp(argv[0], "predict") ? argc < 2 && !ml->list_filepath : argc != 2) usage(1);
 
     ml->in_filepath = argv[1];
 }
@@ -193,6 +252,8 @@ void util_free_config(struct Configs *ml)
     if (ml->loss != NULL) free(ml->loss);
     if (ml->neurons != NULL) free(ml->neurons);
     if (ml->weights_filepath != NULL) free(ml->weights_filepath);
+    if (ml->blas_backend != NULL) free(ml->blas_backend);
+    if (ml->weights_filepaths != NULL) free(ml->weights_filepaths);
 
     if (ml->input_keys != NULL) {
         for (size_t i = 0; i < ml->n_input_keys; i++)
@@ -234,11 +295,24 @@ void util_free_config(struct Configs *ml)
         free(ml->n_categorical_values);
         free(ml->categorical_values);
     }
+
+    if (ml->sweep_keys != NULL) {
+        for (size_t i = 0; i < ml->n_sweep_keys; i++) {
+            for (size_t j = 0; j < ml->n_sweep_values[i]; j++) {
+                free(ml->sweep_values[i][j]);
+            }
+            free(ml->sweep_keys[i]);
+            free(ml->sweep_values[i]);
+        }
+        free(ml->n_sweep_values);
+        free(ml->sweep_values);
+        free(ml->sweep_keys);
+    }
 }
 
 void util_load_config(struct Configs *ml, char *filepath)
 {
-    enum Section {NET, PREPROCESSING, CATEGORICAL, LAYER, OUT_LAYER};
+    enum Section {NET, PREPROCESSING, CATEGORICAL, LAYER, OUT_LAYER, SWEEP};
     enum Section section;
     int line_number = 0;
     char line_buffer[BUFFER_SIZE], line_buffer_original[BUFFER_SIZE];
@@ -265,6 +339,8 @@ void util_load_config(struct Configs *ml, char *filepath)
                 section = PREPROCESSING;
             } else if (!strcmp("categorical_fields", token_buffer)) {
                 section = CATEGORICAL;
+            } else if (!strcmp("sweep", token_buffer)) {
+                section = SWEEP;
             } else {
                 die("util_load_config() Error: Unknown section '%s' on %s",
                     line_buffer, filepath);
@@ -314,6 +390,9 @@ void util_load_config(struct Configs *ml, char *filepath)
         case CATEGORICAL:
             load_categorical_cfgs(ml, key, value, ptr_buffer);
             break;
+        case SWEEP:
+            load_sweep_cfgs(ml, key, value, ptr_buffer, filepath);
+            break;
         case LAYER:
             load_lyr_cfgs(ml, key, value, filepath);
             break;
@@ -410,6 +489,20 @@ void load_net_cfgs(struct Configs *cfg, char *key, char *value, char *strtok_ptr
     else if (!strcmp(key, "alpha"))     cfg->alpha = (double)atof(value);
     else if (!strcmp(key, "inputs"))    cfg->input_keys = config_read_values(&(cfg->n_input_keys), value, &strtok_ptr);
     else if (!strcmp(key, "labels"))    cfg->label_keys = config_read_values(&(cfg->n_label_keys), value, &strtok_ptr);
+    else if (!strcmp(key, "features"))  cfg->n_features = (size_t)atol(value);
+    else if (!strcmp(key, "sparsity"))  cfg->sparsity = atof(value);
+    else if (!strcmp(key, "sparse_density")) cfg->sparse_density = atof(value);
+    else if (!strcmp(key, "blas"))      cfg->blas_backend = e_strdup(value);
+    else if (!strcmp(key, "blas_threads")) cfg->blas_threads = atoi(value);
+    else if (!strcmp(key, "stream_buffer")) cfg->stream_buffer = (size_t)atol(value);
+    else if (!strcmp(key, "stream_block")) cfg->stream_block = (size_t)atol(value);
+    else if (!strcmp(key, "prefetch"))  cfg->prefetch = (size_t)atol(value);
+    else if (!strcmp(key, "predict_chunk")) cfg->predict_chunk = (size_t)atol(value);
+    else if (!strcmp(key, "activation_accuracy")) {
+        if (!strcmp(value, "fast"))         cfg->fast_activations = true;
+        else if (!strcmp(value, "high"))    cfg->fast_activations = false;
+        else die("util_load_config() Error: activation_accuracy must be 'high' or 'fast' not '%s'", value);
+    }
     else die("util_load_config() Error: Invalid parameter '%s' in [net] section on file %s.", key, filepath);
 }
 
@@ -419,6 +512,35 @@ void load_preprocess_cfgs(struct Configs *cfg, char *key, char *value, char *str
     else die("util_load_config() Error: Invalid parameter '%s' in [preprocess] section on file %s", key, filepath);
 }
 
+/* net and layer keys trained by ml sweep, each one takes a list of values */
+void load_sweep_cfgs(struct Configs *cfg, char *key, char *value, char *strtok_ptr, char *filepath)
+{
+    size_t layer, size = cfg->n_sweep_keys;
+    int end = 0;
+
+    if (!strcmp(key, "threads")) {
+        cfg->sweep_threads = (size_t)atol(value);
+        return;
+    } else if (!strcmp(key, "mode")) {
+        if (!strcmp(value, "grid"))         cfg->sweep_list = false;
+        else if (!strcmp(value, "list"))    cfg->sweep_list = true;
+        else die("util_load_config() Error: sweep mode must be 'grid' or 'list' not '%s'", value);
+        return;
+    }
+
+    if (strcmp(key, "alpha") && strcmp(key, "epochs") && strcmp(key, "batch")
+        && !(sscanf(key, "neurons.%zu%n", &layer, &end) == 1 && !key[end])
+        && !(sscanf(key, "activation.%zu%n", &layer, &end) == 1 && !key[end])) {
+        die("util_load_config() Error: Invalid parameter '%s' in [sweep] section on file %s", key, filepath);
+    }
+
+    cfg->sweep_keys = erealloc(cfg->sweep_keys, sizeof(char *) * (size + 1));
+    cfg->sweep_values = erealloc(cfg->sweep_values, sizeof(char **) * (size + 1));
+    cfg->n_sweep_values = erealloc(cfg->n_sweep_values, sizeof(size_t) * (size + 1));
+    cfg->sweep_keys[size] = e_strdup(key);
+    cfg->sweep_values[size] = config_read_values(cfg->n_sweep_values + size, value, &strtok_ptr);
+    cfg->n_sweep_keys++;
+}
 
 void load_categorical_cfgs(
         struct Configs *cfg,
@@ -469,9 +591,15 @@ int util_get_key_index(char *key, char **keys, size_t n_keys)
     return -1;
 }
 
-int util_argmax(double *values, size_t n_values)
+int util_get_value_index(const char *value, char **sorted_values, size_t n_values)
+{
+    char **ptr = bsearch(&value, sorted_values, n_values, sizeof(char *), cmpstringp);
+    return (ptr) ? (int)(ptr - sorted_values) : -1;
+}
+
+int util_argmax(nn_float *values, size_t n_values)
 {
-    double value = values[0];
+    nn_float value = values[0];
     size_t i, j;
     for (i = j = 0; i < n_values; i++) {
         if (values[i] > value) j = i;
@@ -4,6 +4,13 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+/* network values type, build with PRECISION=float32 for single precision */
+#ifdef NN_FLOAT32
+typedef float nn_float;
+#else
+typedef double nn_float;
+#endif
+
 struct Configs {
     /* net cfgs */
     size_t epochs;
@@ -12,20 +19,41 @@ struct Configs {
     char *loss;
     char **input_keys, **label_keys;
     size_t n_input_keys, n_label_keys;
+    size_t n_features;
     char **categorical_keys, ***categorical_values;
     size_t n_categorical_keys, *n_categorical_values;
     char *weights_filepath;
     char *config_filepath;
     bool shuffle;
+    bool fast_activations;
+    double sparsity, sparse_density;
+    char *blas_backend;
+    int blas_threads;
+    size_t stream_buffer, stream_block;
+    size_t prefetch;
+    size_t predict_chunk;
+    bool quiet; // no per batch loss nor loader report on training
     /* preprocessing */
     char **onehot_keys;
     size_t n_onehot_keys;
+    /* sweep cfgs */
+    char **sweep_keys, ***sweep_values;
+    size_t n_sweep_keys, *n_sweep_values;
+    bool sweep_list;
+    size_t sweep_threads;
+    size_t folds;
     /* cli cfgs */
     char *file_format;
     char *in_filepath;
     char *out_filepath;
     int decimal_precision;
     bool only_out;
+    bool compact;
+    char **weights_filepaths;
+    size_t n_weights_filepaths;
+    bool each_model;
+    char *list_filepath;
+    size_t jobs;
     /* layer cfgs */
     size_t network_size;
     size_t *neurons;
@@ -36,9 +64,11 @@ void usage(int exit_code);
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
 void *erealloc(void *ptr, size_t size);
+void *ealigned_calloc(size_t alignment, size_t nmemb, size_t size);
 char *e_strdup(const char *s);
 int util_get_key_index(char *key, char **keys, size_t n_keys);
-int util_argmax(double *values, size_t n_values);
+int util_get_value_index(const char *value, char **sorted_values, size_t n_values);
+int util_argmax(nn_float *values, size_t n_values);
 void util_load_cli(struct Configs *ml, int argc, char *argv[]);
 void util_load_config(struct Configs *ml, char *filepath);
 void util_free_config(struct Configs *ml);